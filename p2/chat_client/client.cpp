@@ -1,5 +1,16 @@
+//Chat client. Interactive by default: lines typed on stdin go to the
+//server, lines from the server are printed.
+//
+//-b is a batch mode for soak tests: a file (-f) or stdin is streamed to the
+//server in large blocks, sent with writev straight out of a ring and
+//without waiting for replies, while the replies are read as they come and
+//split into lines. -q only counts the replies, -t prints throughput to
+//stderr at the end. The client exits once everything is sent and the
+//server has been quiet for the linger time (-l).
+
 #include <iostream>
 #include <algorithm>
+#include <memory>
 #include <set>
 
 #include <sys/types.h>
@@ -7,46 +18,266 @@
 #include <netinet/in.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <time.h>
 
 #include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "../chat_server/ring_buffer.h"
+
+#ifndef MSG_HAVEMORE
+#define MSG_HAVEMORE 0
+#endif
+
 void logstr(std::string message) {
     std::cout << message << std::endl;
 }
 
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+struct Options {
+    unsigned short port = 3100;
+    bool batch = false;
+    const char *file = nullptr;     //batch input, stdin if not given
+    bool quiet = false;
+    bool throughput = false;
+    unsigned linger_ms = 500;
+};
+
+//Splits what the server sends into lines; a line may arrive in any number
+//of pieces, and one recv may hold many lines.
+class LineReader {
+public:
+    //Calls on_line(line, length) for every complete line, without the '\n'.
+    template <class Handler>
+    void feed(const char *data, size_t size, Handler on_line) {
+        const char *end = data + size;
+        while (data < end) {
+            const char *newline = static_cast<const char *>(memchr(data, '\n', end - data));
+            if (!newline) {
+                partial_.append(data, end - data);
+                return;
+            }
+            if (partial_.empty())
+                on_line(data, newline - data);
+            else {
+                partial_.append(data, newline - data);
+                on_line(partial_.data(), partial_.size());
+                partial_.clear();
+            }
+            data = newline + 1;
+        }
+    }
+
+private:
+    std::string partial_;
+};
+
+class BatchClient {
+public:
+    enum { ring_size = 1 << 20, recv_size = 256 * 1024 };
+
+    BatchClient(int socket, int input, const Options &options)
+    : socket_(socket), input_(input), options_(options), out_(new RingBuffer<ring_size>),
+      input_done_(false), last_byte_('\n'), sent_lines_(0), sent_bytes_(0),
+      received_lines_(0), received_bytes_(0), elapsed_(0) {}
+
+    //False if the server closed the connection first.
+    bool run() {
+        fcntl(socket_, F_SETFL, fcntl(socket_, F_GETFL, 0) | O_NONBLOCK);
+        std::unique_ptr<char[]> buffer(new char[recv_size]);
+        uint64_t start = now_ns();
+        uint64_t last_activity = start;
+
+        while (true) {
+            bool sending = !input_done_ || !out_->empty();
+            struct pollfd fds[2];
+            fds[0].fd = input_done_ || out_->room() == 0 ? -1 : input_;
+            fds[0].events = POLLIN;
+            fds[1].fd = socket_;
+            fds[1].events = POLLIN | (out_->empty() ? 0 : POLLOUT);
+            fds[0].revents = fds[1].revents = 0;
+            int timeout = sending ? -1 : std::max<int>(0, options_.linger_ms - (now_ns() - last_activity) / 1000000);
+            int count = poll(fds, 2, timeout);
+            if (count < 0 && errno != EINTR)
+                return false;
+            if (count == 0 && !sending) {
+                finish(start, last_activity);
+                return true;
+            }
+
+            if (fds[0].revents)
+                read_input();
+            //Pipelined: whatever is in the ring goes out now, replies or not.
+            if (!out_->empty()) {
+                ssize_t SentSize = out_->write_to(socket_);
+                if (SentSize < 0 && errno != EAGAIN && errno != EINTR)
+                    return false;
+                if (SentSize > 0)
+                    sent_bytes_ += SentSize;
+            }
+            if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+                ssize_t RecvSize = recv(socket_, buffer.get(), recv_size, 0);
+                if (RecvSize == 0 || (RecvSize < 0 && errno != EAGAIN && errno != EINTR)) {
+                    finish(start, now_ns());
+                    return false;
+                }
+                if (RecvSize > 0) {
+                    receive(buffer.get(), RecvSize);
+                    last_activity = now_ns();
+                }
+            }
+            if (sending)
+                last_activity = now_ns();
+        }
+    }
+
+    void report() const {
+        double seconds = elapsed_ / 1e9;
+        std::cerr << "sent: " << sent_lines_ << " lines, " << sent_bytes_ << " bytes, "
+                  << uint64_t(sent_lines_ / seconds) << " lines/s, " << sent_bytes_ / seconds / 1e6 << " MB/s" << std::endl;
+        std::cerr << "received: " << received_lines_ << " lines, " << received_bytes_ << " bytes, "
+                  << uint64_t(received_lines_ / seconds) << " lines/s, " << received_bytes_ / seconds / 1e6 << " MB/s" << std::endl;
+        std::cerr << "elapsed: " << seconds << " s" << std::endl;
+    }
+
+private:
+    void read_input() {
+        struct iovec iov[2];
+        int count = out_->space(iov);
+        ssize_t ReadSize = readv(input_, iov, count);
+        if (ReadSize < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (ReadSize <= 0) {
+            input_done_ = true;
+            //The server only handles complete lines.
+            if (last_byte_ != '\n') {
+                struct iovec newline = { const_cast<char *>("\n"), 1 };
+                out_->append(&newline, 1);
+                ++sent_lines_;
+            }
+            return;
+        }
+        for (int i = 0; i < count && ReadSize > 0; ++i) {
+            size_t length = std::min<size_t>(iov[i].iov_len, ReadSize);
+            const char *data = static_cast<const char *>(iov[i].iov_base);
+            sent_lines_ += std::count(data, data + length, '\n');
+            last_byte_ = data[length - 1];
+            out_->commit(length);
+            ReadSize -= length;
+        }
+    }
+
+    //Complete lines go to stdout in one write per recv.
+    void receive(const char *data, size_t size) {
+        received_bytes_ += size;
+        lines_.clear();
+        reader_.feed(data, size, [this](const char *line, size_t length) {
+            ++received_lines_;
+            if (!options_.quiet) {
+                lines_.append(line, length);
+                lines_ += '\n';
+            }
+        });
+        for (size_t written = 0; written < lines_.size();) {
+            ssize_t result = write(STDOUT_FILENO, lines_.data() + written, lines_.size() - written);
+            if (result <= 0 && errno != EINTR)
+                break;
+            if (result > 0)
+                written += result;
+        }
+    }
+
+    //The linger time is not part of the run.
+    void finish(uint64_t start, uint64_t end) {
+        elapsed_ = end - start;
+    }
+
+    int socket_, input_;
+    Options options_;
+    std::unique_ptr<RingBuffer<ring_size>> out_;
+    LineReader reader_;
+    std::string lines_;
+    bool input_done_;
+    char last_byte_;
+    uint64_t sent_lines_, sent_bytes_, received_lines_, received_bytes_;
+    uint64_t elapsed_;
+};
+
+void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [-p port] [-b [-f file] [-q] [-t] [-l linger_ms]]" << std::endl;
+}
+
 int main(int argc, char **argv) {
+    Options options;
+    int Option;
+    while ((Option = getopt(argc, argv, "p:bf:qtl:")) != -1) {
+        switch (Option) {
+            case 'p': options.port = atoi(optarg); break;
+            case 'b': options.batch = true; break;
+            case 'f': options.file = optarg; break;
+            case 'q': options.quiet = true; break;
+            case 't': options.throughput = true; break;
+            case 'l': options.linger_ms = atoi(optarg); break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+
     int ClientSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
     std::set<int> SlaveSockets;
     SlaveSockets.insert(0);
-    
+
     if(ClientSocket == -1) {
         std::cout << strerror(errno) << std::endl;
         return 1;
     }
-    
+
     struct sockaddr_in SockAddr;
     SockAddr.sin_family = AF_INET;
-    SockAddr.sin_port = htons(3100);
+    SockAddr.sin_port = htons(options.port);
     SockAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-    
+
     int Result = connect(ClientSocket, (struct sockaddr *)&SockAddr, sizeof(SockAddr));
-    
+
     if(Result == -1) {
         std::cout << strerror(errno) << std::endl;
         return 1;
     }
-    
+
+    if (options.batch) {
+        signal(SIGPIPE, SIG_IGN);
+        int Input = STDIN_FILENO;
+        if (options.file && (Input = open(options.file, O_RDONLY)) == -1) {
+            std::cerr << options.file << ": " << strerror(errno) << std::endl;
+            return 1;
+        }
+        BatchClient client(ClientSocket, Input, options);
+        bool Finished = client.run();
+        if (options.throughput)
+            client.report();
+        close(ClientSocket);
+        return Finished ? 0 : 1;
+    }
+
     logstr("connected to the server");
-    
+
     std::string message;
-    
+    LineReader reader;
+
     while (true) {
         fd_set Set;
         FD_ZERO(&Set);
         FD_SET(ClientSocket, &Set);
         FD_SET(0, &Set);
-        
+
         select(ClientSocket+1, &Set, NULL, NULL, NULL);
         //SEND
         if(FD_ISSET(0, &Set))
@@ -60,13 +291,13 @@ int main(int argc, char **argv) {
         {
             static char Buffer[1024];
             int RecvSize = recv(ClientSocket, Buffer, 1024, MSG_HAVEMORE);
-            if((RecvSize == 0) && (errno != EAGAIN)) {
+            if(RecvSize <= 0) {
                 close(ClientSocket);
                 break;
             }
-            else if(RecvSize != 0) {
-                logstr(std::string(Buffer).substr(0, RecvSize-1));
-            }
+            reader.feed(Buffer, RecvSize, [](const char *line, size_t length) {
+                logstr(std::string(line, length));
+            });
         }
     }
     return 0;
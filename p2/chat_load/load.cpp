@@ -0,0 +1,467 @@
+//Load generator for chatsrv.
+//Architecture: Linux (epoll) and Mac OS X (kqueue).
+//
+//Opens N connections, lets S of them send timestamped messages at a fixed
+//total rate and measures how long every copy takes to come back. K clients
+//never read, to see how the server copes with slow readers.
+//
+//With -S it simulates a reconnect storm instead: all N clients connect at
+//once and it measures how long each takes to be greeted.
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../chat_server/poller.h"
+
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+int set_nonblock(int fd) {
+    int flags;
+    if (-1 == (flags = fcntl(fd, F_GETFL, 0)))
+        flags = 0;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+//Log-linear latency histogram: 32 sub-buckets per power of two, so every
+//percentile is within ~3% of the recorded value.
+class Histogram {
+public:
+    enum { sub_bits = 5, sub_buckets = 1 << sub_bits };
+
+    Histogram() : counts_(64 * sub_buckets, 0), total_(0), max_(0) {}
+
+    void record(uint64_t value) {
+        ++counts_[bucket(value)];
+        ++total_;
+        if (value > max_)
+            max_ = value;
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t rank = static_cast<uint64_t>(p * total_);
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts_.size(); ++i) {
+            seen += counts_[i];
+            if (seen > rank)
+                return lower_bound(i);
+        }
+        return max_;
+    }
+
+    uint64_t count() const { return total_; }
+    uint64_t max() const { return max_; }
+
+private:
+    static size_t bucket(uint64_t value) {
+        if (value < sub_buckets)
+            return value;
+        int shift = 63 - __builtin_clzll(value) - sub_bits;
+        return (shift + 1) * sub_buckets + (value >> shift) - sub_buckets;
+    }
+
+    static uint64_t lower_bound(size_t index) {
+        if (index < sub_buckets)
+            return index;
+        return (uint64_t(sub_buckets) + index % sub_buckets) << (index / sub_buckets - 1);
+    }
+
+    std::vector<uint64_t> counts_;
+    uint64_t total_, max_;
+};
+
+struct Options {
+    std::string host = "127.0.0.1";
+    std::vector<unsigned short> ports = { 3100 };  //federated servers share the clients
+    unsigned clients = 1000;
+    unsigned senders = 10;
+    unsigned slow = 0;
+    unsigned rate = 1000;       //messages per second, all senders together
+    unsigned duration = 10;     //seconds of sending
+    unsigned size = 64;         //message length including the header
+    bool storm = false;         //only connect, all at once
+};
+
+struct LoadClient {
+    int fd = -1;
+    bool sender = false;
+    bool slow = false;
+    bool welcomed = false;
+    bool closed = false;
+    std::string in;
+    std::string out;
+};
+
+class LoadGenerator {
+public:
+    LoadGenerator(const Options &options)
+    : options_(options), sent_(0), delivered_(0), foreign_(0), dropped_fast_(0), dropped_slow_(0) {}
+
+    bool connect_all() {
+        raise_fd_limit();
+        clients_.resize(options_.clients);
+        by_fd_.clear();
+        for (unsigned i = 0; i < options_.clients; ++i) {
+            LoadClient &client = clients_[i];
+            client.sender = i < options_.senders;
+            client.slow = !client.sender && i >= options_.clients - options_.slow;
+            client.fd = open_connection(i);
+            if (client.fd == -1) {
+                std::cerr << "connect #" << i << ": " << strerror(errno) << std::endl;
+                return false;
+            }
+            if (by_fd_.size() <= static_cast<size_t>(client.fd))
+                by_fd_.resize(client.fd + 1, -1);
+            by_fd_[client.fd] = i;
+            poller_.add(client.fd);
+            if (client.slow)
+                poller_.set_interest(client.fd, false, false);
+        }
+
+        //Measure only what was sent after everybody got the greeting.
+        unsigned fast = options_.clients - options_.slow;
+        unsigned welcomed = 0;
+        uint64_t deadline = now_ns() + 30ull * 1000000000;
+        while (welcomed < fast && now_ns() < deadline) {
+            int count = poller_.wait(100);
+            for (int i = 0; i < count; ++i) {
+                LoadClient &client = clients_[by_fd_[poller_.event(i).fd]];
+                bool was = client.welcomed;
+                handle_event(client, poller_.event(i));
+                if (!was && client.welcomed)
+                    ++welcomed;
+            }
+        }
+        if (welcomed < fast) {
+            std::cerr << "only " << welcomed << " of " << fast << " clients were greeted" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    //Fire all connects without waiting, then time each greeting. Clients
+    //the server turns away see EOF before the greeting. Greetings are
+    //collected between batches of connects, so that the time to greeting
+    //is the server's and not that of this loop.
+    void storm() {
+        raise_fd_limit();
+        clients_.resize(options_.clients);
+        by_fd_.clear();
+        std::vector<uint64_t> started(options_.clients);
+        unsigned done = 0;
+        auto collect = [this, &started, &done](int timeout) {
+            int count = poller_.wait(timeout);
+            for (int i = 0; i < count; ++i) {
+                unsigned index = by_fd_[poller_.event(i).fd];
+                LoadClient &client = clients_[index];
+                if (client.welcomed || client.closed)
+                    continue;
+                handle_event(client, poller_.event(i));
+                if (client.welcomed)
+                    latency_.record(now_ns() - started[index]);
+                if (client.welcomed || client.closed)
+                    ++done;
+            }
+        };
+
+        uint64_t start = now_ns();
+        for (unsigned i = 0; i < options_.clients; ++i) {
+            LoadClient &client = clients_[i];
+            started[i] = now_ns();
+            client.fd = open_connection(i, false);
+            if (client.fd == -1) {
+                client.closed = true;
+                ++dropped_fast_;
+                ++done;
+                continue;
+            }
+            if (by_fd_.size() <= static_cast<size_t>(client.fd))
+                by_fd_.resize(client.fd + 1, -1);
+            by_fd_[client.fd] = i;
+            poller_.add(client.fd);
+            if (i % 64 == 63)
+                collect(0);
+        }
+
+        uint64_t deadline = now_ns() + 60ull * 1000000000;
+        while (done < options_.clients && now_ns() < deadline)
+            collect(100);
+        elapsed_ = now_ns() - start;
+    }
+
+    void report_storm() const {
+        std::cout << "storm: " << latency_.count() << " of " << options_.clients << " clients greeted in "
+                  << std::fixed << std::setprecision(1) << elapsed_ / 1e6 << " ms, "
+                  << dropped_fast_ << " turned away" << std::endl;
+        std::cout << "time to greeting ms: p50 " << latency_.percentile(0.5) / 1e6
+                  << ", p99 " << latency_.percentile(0.99) / 1e6
+                  << ", max " << latency_.max() / 1e6 << std::endl;
+    }
+
+    void run() {
+        uint64_t start = now_ns();
+        uint64_t stop = start + uint64_t(options_.duration) * 1000000000;
+        uint64_t interval = options_.rate ? 1000000000ull / options_.rate : 0;
+        uint64_t next = start;
+        unsigned turn = 0;
+
+        while (true) {
+            uint64_t now = now_ns();
+            while (interval && now < stop && next <= now && options_.senders) {
+                send_message(clients_[turn], next);
+                turn = (turn + 1) % options_.senders;
+                next += interval;
+            }
+            if (now >= stop + 2000000000ull || (now >= stop && complete()))
+                break;
+
+            int timeout = now < stop && interval ? static_cast<int>((next > now ? next - now : 0) / 1000000) : 50;
+            int count = poller_.wait(timeout);
+            for (int i = 0; i < count; ++i)
+                handle_event(clients_[by_fd_[poller_.event(i).fd]], poller_.event(i));
+        }
+        elapsed_ = now_ns() - start;
+        probe_slow();
+    }
+
+    void report() const {
+        unsigned fast = options_.clients - options_.slow;
+        uint64_t expected = sent_ * fast;
+        double seconds = elapsed_ / 1e9;
+        std::cout << "connections: " << options_.clients << " (senders " << options_.senders
+                  << ", slow " << options_.slow << ")" << std::endl;
+        std::cout << "sent: " << sent_ << " msgs, " << std::fixed << std::setprecision(0)
+                  << sent_ / double(options_.duration) << " msgs/s" << std::endl;
+        std::cout << "delivered: " << delivered_ << " of " << expected << " msgs, "
+                  << delivered_ / seconds << " msgs/s" << std::endl;
+        std::cout << std::setprecision(1)
+                  << "fan-out latency us: p50 " << latency_.percentile(0.5) / 1e3
+                  << ", p99 " << latency_.percentile(0.99) / 1e3
+                  << ", p999 " << latency_.percentile(0.999) / 1e3
+                  << ", max " << latency_.max() / 1e3 << std::endl;
+        std::cout << "slow clients dropped by server: " << dropped_slow_ << " of " << options_.slow << std::endl;
+        std::cout << "other clients dropped by server: " << dropped_fast_ << std::endl;
+        if (foreign_)
+            std::cout << "unparsed lines: " << foreign_ << std::endl;
+    }
+
+private:
+    void raise_fd_limit() {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < options_.clients + 64) {
+            limit.rlim_cur = std::min<rlim_t>(limit.rlim_max, options_.clients + 64);
+            setrlimit(RLIMIT_NOFILE, &limit);
+        }
+    }
+
+    //A client that never reads cannot see the server's FIN behind the data
+    //it left unread, so start reading on the slow clients and count EOFs.
+    void probe_slow() {
+        for (auto &client : clients_)
+            if (client.slow && !client.closed)
+                poller_.set_interest(client.fd, true, false);
+        uint64_t deadline = now_ns() + 2000000000ull;
+        while (now_ns() < deadline) {
+            int count = poller_.wait(100);
+            if (count == 0)
+                break;
+            for (int i = 0; i < count; ++i)
+                handle_event(clients_[by_fd_[poller_.event(i).fd]], poller_.event(i));
+        }
+    }
+
+    //Blocking connects unless `wait` is false; the socket ends up
+    //non-blocking either way.
+    int open_connection(unsigned index, bool wait = true) {
+        int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (fd == -1)
+            return -1;
+
+        struct sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(options_.ports[index % options_.ports.size()]);
+        inet_pton(AF_INET, options_.host.c_str(), &addr.sin_addr);
+
+        //One source address has ~28k ephemeral ports; spread big runs over
+        //127.0.0.x so that 50k loopback connections fit.
+        if ((ntohl(addr.sin_addr.s_addr) >> 24) == 127) {
+            struct sockaddr_in local;
+            bzero(&local, sizeof(local));
+            local.sin_family = AF_INET;
+            local.sin_addr.s_addr = htonl(0x7f000001 + index / 20000);
+#if defined(IP_BIND_ADDRESS_NO_PORT)
+            //Otherwise bind() searches for a free port on every call, which
+            //gets slow with thousands of them in use.
+            int enable = 1;
+            setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &enable, sizeof(enable));
+#endif
+            bind(fd, (struct sockaddr *)&local, sizeof(local));
+        }
+
+        if (!wait)
+            set_nonblock(fd);
+        if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 && (wait || errno != EINPROGRESS)) {
+            close(fd);
+            return -1;
+        }
+        if (wait)
+            set_nonblock(fd);
+        return fd;
+    }
+
+    void send_message(LoadClient &client, uint64_t stamp) {
+        if (client.closed)
+            return;
+        char header[64];
+        int length = snprintf(header, sizeof(header), "%llu ", static_cast<unsigned long long>(stamp));
+        client.out.append(header, length);
+        if (options_.size > static_cast<unsigned>(length) + 1)
+            client.out.append(options_.size - length - 1, 'x');
+        client.out.push_back('\n');
+        ++sent_;
+        flush(client);
+    }
+
+    void flush(LoadClient &client) {
+        if (client.out.empty())
+            return;
+        ssize_t result = send(client.fd, client.out.data(), client.out.size(), 0);
+        if (result > 0)
+            client.out.erase(0, result);
+        poller_.set_interest(client.fd, !client.slow, !client.out.empty());
+    }
+
+    void handle_event(LoadClient &client, const PollEvent &event) {
+        if (client.closed)
+            return;
+        if (event.writable)
+            flush(client);
+        if (!event.readable)
+            return;
+
+        char buffer[65536];
+        ssize_t result = recv(client.fd, buffer, sizeof(buffer), 0);
+        if (result < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (result <= 0) {
+            client.closed = true;
+            ++(client.slow ? dropped_slow_ : dropped_fast_);
+            close(client.fd);
+            return;
+        }
+        if (client.slow)
+            return;
+
+        uint64_t now = now_ns();
+        client.in.append(buffer, result);
+        size_t begin = 0, end;
+        while ((end = client.in.find('\n', begin)) != std::string::npos) {
+            const char *line = client.in.c_str() + begin;
+            if (!client.welcomed && strncmp(line, "Welcome", 7) == 0)
+                client.welcomed = true;
+            else {
+                char *stop;
+                unsigned long long stamp = strtoull(line, &stop, 10);
+                if (stop != line && *stop == ' ' && stamp <= now) {
+                    latency_.record(now - stamp);
+                    ++delivered_;
+                }
+                else
+                    ++foreign_;
+            }
+            begin = end + 1;
+        }
+        client.in.erase(0, begin);
+    }
+
+    bool complete() const {
+        return delivered_ >= sent_ * (options_.clients - options_.slow - dropped_fast_);
+    }
+
+    Options options_;
+    Poller poller_;
+    std::vector<LoadClient> clients_;
+    std::vector<int> by_fd_;
+    Histogram latency_;
+    uint64_t sent_, delivered_, foreign_, dropped_fast_, dropped_slow_;
+    uint64_t elapsed_ = 0;
+};
+
+void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [-h host] [-p port[,port...]] [-n clients] [-s senders] [-k slow_clients]"
+              << " [-r msgs_per_s] [-d seconds] [-m message_size] [-S]" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    int Option;
+    while ((Option = getopt(argc, argv, "h:p:n:s:k:r:d:m:S")) != -1) {
+        switch (Option) {
+            case 'h': options.host = optarg; break;
+            case 'p': {
+                options.ports.clear();
+                std::string list = optarg;
+                for (size_t start = 0; start < list.size();) {
+                    size_t comma = list.find(',', start);
+                    if (comma == std::string::npos)
+                        comma = list.size();
+                    options.ports.push_back(atoi(list.substr(start, comma - start).c_str()));
+                    start = comma + 1;
+                }
+                break;
+            }
+            case 'n': options.clients = atoi(optarg); break;
+            case 's': options.senders = atoi(optarg); break;
+            case 'k': options.slow = atoi(optarg); break;
+            case 'r': options.rate = atoi(optarg); break;
+            case 'd': options.duration = atoi(optarg); break;
+            case 'm': options.size = atoi(optarg); break;
+            case 'S': options.storm = true; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (options.senders > options.clients || options.senders + options.slow > options.clients
+        || options.duration == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    try {
+        LoadGenerator generator(options);
+        if (options.storm) {
+            generator.storm();
+            generator.report_storm();
+            return 0;
+        }
+        if (!generator.connect_all())
+            return 1;
+        generator.run();
+        generator.report();
+    }
+    catch (std::exception &e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,231 @@
+#ifndef CHATSRV_ASYNC_LOG_H
+#define CHATSRV_ASYNC_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+//Log lines are appended by the event loop to a lock-free byte ring and
+//written out by a background thread in large batches, so a slow stdout
+//never stalls the chat. One producer, one consumer. When the ring is full
+//the producer drops the oldest whole lines; a line is never cut or mixed
+//with another one. Lines written with keep=true (connection events) are
+//not dropped: they are taken out and queued again behind the new line. If
+//kept lines alone fill the ring, they stay and the new line is dropped.
+//Records are a 4-byte length, with keep_flag set for kept lines, and text.
+class AsyncLog {
+public:
+    enum : uint32_t { batch_size = 65536, keep_flag = 0x80000000u };
+
+    AsyncLog(int fd, size_t capacity = 1 << 20)
+    : fd_(fd), buf_(capacity), head_(0), tail_(0), dropped_(0), sleeping_(false), stop_(false),
+      thread_(&AsyncLog::drain, this) {}
+
+    ~AsyncLog() {
+        stop_ = true;
+        wake();
+        thread_.join();
+    }
+
+    AsyncLog(const AsyncLog &) = delete;
+    AsyncLog &operator=(const AsyncLog &) = delete;
+
+    //Append one line; '\n' is added. Called from the event loop only.
+    void write(const struct iovec *parts, int count, bool keep = false) {
+        uint32_t length = 1;
+        for (int i = 0; i < count; ++i)
+            length += parts[i].iov_len;
+        if (sizeof(length) + length > buf_.size() / 2)
+            return;
+
+        uint64_t tail = tail_.load(std::memory_order_relaxed);
+        if (!make_room(tail, sizeof(length) + length)) {
+            //The ring is empty now, and the rescued lines came out of it.
+            tail_.store(put_rescued(tail));
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            if (sleeping_.load())
+                wake();
+            return;
+        }
+
+        tail = put_rescued(tail);
+
+        uint32_t header = keep ? length | keep_flag : length;
+        copy_in(tail, &header, sizeof(header));
+        tail += sizeof(header);
+        for (int i = 0; i < count; ++i) {
+            copy_in(tail, parts[i].iov_base, parts[i].iov_len);
+            tail += parts[i].iov_len;
+        }
+        copy_in(tail, "\n", 1);
+        tail_.store(tail + 1);
+
+        if (sleeping_.load())
+            wake();
+    }
+
+    void write(const std::string &line, bool keep = false) {
+        struct iovec part = { const_cast<char *>(line.data()), line.size() };
+        write(&part, 1, keep);
+    }
+
+    uint64_t dropped() const { return dropped_.load(std::memory_order_relaxed); }
+
+private:
+    //Drop the oldest records until `need` bytes plus the rescued lines fit.
+    bool make_room(uint64_t tail, size_t need) {
+        uint64_t head = head_.load(std::memory_order_acquire);
+        while (buf_.size() - (tail - head) < need + rescued_bytes_) {
+            if (head == tail)
+                return false;
+            uint32_t header;
+            copy_out(head, &header, sizeof(header));
+            uint32_t length = header & ~keep_flag;
+            std::string line;
+            if (header & keep_flag) {
+                line.resize(length);
+                copy_out(head + sizeof(header), &line[0], length);
+            }
+            if (!head_.compare_exchange_weak(head, head + sizeof(header) + length))
+                continue;
+            if (header & keep_flag) {
+                rescued_bytes_ += sizeof(header) + length;
+                rescued_.push_back(std::move(line));
+            }
+            else
+                dropped_.fetch_add(1, std::memory_order_relaxed);
+            head += sizeof(header) + length;
+        }
+        return true;
+    }
+
+    //Queue the rescued lines again at `tail`; returns the new tail.
+    uint64_t put_rescued(uint64_t tail) {
+        for (auto &line : rescued_) {
+            uint32_t header = uint32_t(line.size()) | keep_flag;
+            copy_in(tail, &header, sizeof(header));
+            copy_in(tail + sizeof(header), line.data(), line.size());
+            tail += sizeof(header) + line.size();
+        }
+        rescued_.clear();
+        rescued_bytes_ = 0;
+        return tail;
+    }
+
+    void wake() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        cond_.notify_one();
+    }
+
+    void drain() {
+        //Signals are for the event loop, which must wake up to handle them.
+        sigset_t all;
+        sigfillset(&all);
+        pthread_sigmask(SIG_BLOCK, &all, nullptr);
+
+        std::vector<char> batch(batch_size);
+        std::string out;
+        uint64_t reported = 0;
+        while (true) {
+            uint64_t head = head_.load(std::memory_order_acquire);
+            uint64_t tail = tail_.load();
+            if (head == tail) {
+                if (stop_)
+                    return;
+                std::unique_lock<std::mutex> lock(mutex_);
+                sleeping_ = true;
+                if (tail_.load() == head_.load() && !stop_)
+                    cond_.wait_for(lock, std::chrono::milliseconds(100));
+                sleeping_ = false;
+                continue;
+            }
+
+            //Copy first, then claim with a CAS. If the producer dropped lines
+            //meanwhile the copy may be torn, so it is thrown away.
+            size_t taken = tail - head < batch.size() ? tail - head : batch.size();
+            copy_out(head, batch.data(), taken);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            size_t used = whole_records(batch.data(), taken);
+            if (!head_.compare_exchange_strong(head, head + used))
+                continue;
+
+            out.clear();
+            for (size_t offset = 0; offset < used;) {
+                uint32_t header;
+                memcpy(&header, batch.data() + offset, sizeof(header));
+                uint32_t length = header & ~keep_flag;
+                out.append(batch.data() + offset + sizeof(header), length);
+                offset += sizeof(header) + length;
+            }
+            uint64_t dropped = dropped_.load(std::memory_order_relaxed);
+            if (dropped != reported) {
+                out += "log: " + std::to_string(dropped - reported) + " lines dropped\n";
+                reported = dropped;
+            }
+            write_all(out.data(), out.size());
+        }
+    }
+
+    static size_t whole_records(const char *data, size_t size) {
+        size_t offset = 0;
+        while (offset + sizeof(uint32_t) <= size) {
+            uint32_t header;
+            memcpy(&header, data + offset, sizeof(header));
+            uint32_t length = header & ~keep_flag;
+            if (offset + sizeof(header) + length > size)
+                break;
+            offset += sizeof(header) + length;
+        }
+        return offset;
+    }
+
+    void write_all(const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t result = ::write(fd_, data, size);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                return;
+            data += result;
+            size -= result;
+        }
+    }
+
+    void copy_in(uint64_t at, const void *from, size_t size) {
+        size_t start = at % buf_.size();
+        size_t first = buf_.size() - start < size ? buf_.size() - start : size;
+        memcpy(&buf_[start], from, first);
+        memcpy(&buf_[0], static_cast<const char *>(from) + first, size - first);
+    }
+
+    void copy_out(uint64_t at, void *to, size_t size) const {
+        size_t start = at % buf_.size();
+        size_t first = buf_.size() - start < size ? buf_.size() - start : size;
+        memcpy(to, &buf_[start], first);
+        memcpy(static_cast<char *>(to) + first, &buf_[0], size - first);
+    }
+
+    int fd_;
+    std::vector<char> buf_;
+    std::atomic<uint64_t> head_, tail_;  //byte positions, only ever grow
+    std::atomic<uint64_t> dropped_;
+    std::vector<std::string> rescued_;  //kept lines taken out by make_room
+    size_t rescued_bytes_ = 0;
+    std::atomic<bool> sleeping_, stop_;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::thread thread_;
+};
+
+#endif //CHATSRV_ASYNC_LOG_H
@@ -0,0 +1,133 @@
+#ifndef CHATSRV_CONNECTION_TABLE_H
+#define CHATSRV_CONNECTION_TABLE_H
+
+#include <stdint.h>
+#include <memory>
+#include <vector>
+
+#include "line_framer.h"
+#include "ring_buffer.h"
+#include "slab_pool.h"
+#include "timer_wheel.h"
+
+//Messages a slow reader has not accepted yet. A client that falls further
+//behind than this is disconnected instead of buffering without bound.
+typedef RingBuffer<65536> OutputBuffer;
+
+//Per-client state. Kept small on purpose: an idle client owns no buffers,
+//rings are taken from the pools only while there is partial input or
+//unsent output. Times are the low 32 bits of the loop clock in ms.
+struct Connection {
+    int fd;
+    uint32_t active_index;  //position in ConnectionTable::active()
+    LineFramer *input;
+    OutputBuffer *output;
+    TimerNode timer;        //idle-read and write-stall deadline
+    uint64_t msg_tokens;    //rate limit buckets, see rate_limiter.h
+    uint64_t byte_tokens;
+    uint32_t last_read_ms;
+    uint32_t last_write_ms; //last progress while output was pending
+    uint32_t room;
+    uint32_t room_index;    //position in the room's member array
+    uint32_t tokens_ms;
+    uint32_t resume_ms;     //when a throttled client may read again
+    bool in_room;
+    bool closing;
+    bool throttled;         //reads paused by the rate limit
+    bool binary;            //negotiated varint-framed messages
+    uint8_t link;           //LinkKind, for server-to-server links
+    uint8_t io_flags;       //owned by the event loop backend
+    uint8_t io_sends;       //sends in flight (io_uring)
+};
+
+//Connections indexed directly by fd. The kernel hands out the lowest free
+//descriptor, so the fd space is dense and a paged array needs no hashing.
+//Pages are allocated once and never move, so Connection pointers are stable.
+class ConnectionTable {
+public:
+    enum { page_size = 1024 };
+
+    Connection *find(int fd) {
+        if (fd < 0 || static_cast<size_t>(fd / page_size) >= pages_.size())
+            return nullptr;
+        Connection *conn = &pages_[fd / page_size][fd % page_size];
+        return conn->fd == fd ? conn : nullptr;
+    }
+
+    Connection *add(int fd) {
+        while (static_cast<size_t>(fd / page_size) >= pages_.size()) {
+            pages_.emplace_back(new Connection[page_size]);
+            for (size_t i = 0; i < page_size; ++i)
+                pages_.back()[i].fd = -1;
+        }
+        Connection *conn = &pages_[fd / page_size][fd % page_size];
+        *conn = Connection();
+        conn->fd = fd;
+        conn->active_index = active_.size();
+        active_.push_back(conn);
+        return conn;
+    }
+
+    //The caller cancels the connection's timer first.
+    void remove(Connection *conn) {
+        release_input(conn);
+        release_output(conn);
+        Connection *last = active_.back();
+        active_[conn->active_index] = last;
+        last->active_index = conn->active_index;
+        active_.pop_back();
+        conn->fd = -1;
+    }
+
+    LineFramer &input(Connection *conn) {
+        if (!conn->input)
+            conn->input = framers_.acquire();
+        return *conn->input;
+    }
+
+    //Give the ring back once everything in it has been consumed.
+    void release_input(Connection *conn) {
+        if (conn->input) {
+            framers_.release(conn->input);
+            conn->input = nullptr;
+        }
+    }
+
+    OutputBuffer &output(Connection *conn) {
+        if (!conn->output)
+            conn->output = outputs_.acquire();
+        return *conn->output;
+    }
+
+    void release_output(Connection *conn) {
+        if (conn->output) {
+            outputs_.release(conn->output);
+            conn->output = nullptr;
+        }
+    }
+
+    //Contiguous list of live connections, in no particular order.
+    const std::vector<Connection *> &active() const { return active_; }
+    size_t size() const { return active_.size(); }
+
+    //Housekeeping: hand unused buffer slabs back after a burst.
+    void trim() {
+        framers_.trim();
+        outputs_.trim();
+    }
+
+    size_t memory_usage() const {
+        return pages_.size() * page_size * sizeof(Connection)
+               + active_.capacity() * sizeof(Connection *)
+               + framers_.memory_usage() + outputs_.memory_usage();
+    }
+    size_t buffers_in_use() const { return framers_.in_use() + outputs_.in_use(); }
+
+private:
+    std::vector<std::unique_ptr<Connection[]>> pages_;
+    std::vector<Connection *> active_;
+    SlabPool<LineFramer> framers_;
+    SlabPool<OutputBuffer, 16> outputs_;
+};
+
+#endif //CHATSRV_CONNECTION_TABLE_H
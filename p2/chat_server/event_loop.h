@@ -0,0 +1,86 @@
+#ifndef CHATSRV_EVENT_LOOP_H
+#define CHATSRV_EVENT_LOOP_H
+
+#include <stdint.h>
+#include <string>
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include "connection_table.h"
+
+//What an I/O backend reports back to the chat logic. Callbacks are never
+//made for connections that are already closing.
+class EventHandler {
+public:
+    virtual ~EventHandler() {}
+    virtual void on_accept(Connection *conn) = 0;  //conn is already in the table
+    virtual void on_input(Connection *conn) = 0;   //new bytes in the input ring
+    virtual void on_hangup(Connection *conn) = 0;  //EOF or a socket error
+    virtual void on_output(Connection *conn) = 0;  //output got queued or made progress
+};
+
+//I/O backend for the listening socket and all clients. The server decides
+//when a client goes away; the backend closes the fd once nothing is pending
+//on it any more and removes the connection from the table.
+class EventLoop {
+public:
+    EventLoop(ConnectionTable &clients, EventHandler &handler)
+    : clients_(clients), handler_(handler), syscalls_(0), accept_batch_(256), max_connections_(0), rejected_(0) {}
+    virtual ~EventLoop() {}
+
+    virtual const char *name() const = 0;
+
+    //Start an outgoing connection; `addr` must stay valid until it is up.
+    //Sends may be queued right away. Failure is reported through on_hangup,
+    //or as nullptr if there was no socket to start with.
+    virtual Connection *connect(const struct sockaddr_in *addr) = 0;
+
+    //Take over a connected client from another process (hot restart).
+    virtual Connection *adopt(int fd) = 0;
+
+    //Send or queue one message. False if the client's output ring is full.
+    virtual bool send(Connection *conn, struct iovec *iov, int count) = 0;
+    virtual void close(Connection *conn) = 0;
+
+    //Stop reading from a client, leaving its data in the socket, and start
+    //again. Input already in the ring stays there.
+    virtual void pause_reads(Connection *conn) = 0;
+    virtual void resume_reads(Connection *conn) = 0;
+
+    //Wait for at most timeout_ms (-1 blocks) and dispatch what happened.
+    virtual void poll(int timeout_ms) = 0;
+
+    //End of a loop iteration: hand batched work to the kernel.
+    virtual void flush() {}
+
+    //Hot restart: stop all I/O in flight, so that every client's state is
+    //in its rings and the fds can be passed on. Nothing runs afterwards.
+    virtual void quiesce() {}
+
+    //Input the backend received but has not handed to the framer yet.
+    virtual std::string take_unread(Connection *) { return std::string(); }
+
+    //Admission control: at most `accept_batch` accepts per wakeup, so that
+    //a reconnect storm does not starve the clients already connected, and
+    //at most `max_connections` connections (0 is no limit). Connections
+    //over the limit are closed right after the accept.
+    void set_admission(unsigned accept_batch, size_t max_connections) {
+        accept_batch_ = accept_batch;
+        max_connections_ = max_connections;
+    }
+
+    uint64_t syscalls() const { return syscalls_; }
+    uint64_t rejected() const { return rejected_; }
+
+protected:
+    bool admit() const { return max_connections_ == 0 || clients_.size() < max_connections_; }
+
+    ConnectionTable &clients_;
+    EventHandler &handler_;
+    uint64_t syscalls_;
+    unsigned accept_batch_;
+    size_t max_connections_;
+    uint64_t rejected_;
+};
+
+#endif //CHATSRV_EVENT_LOOP_H
@@ -0,0 +1,215 @@
+#ifndef CHATSRV_FEDERATION_H
+#define CHATSRV_FEDERATION_H
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "line_framer.h"
+
+//Server-to-server links. Every server dials each configured peer, sends
+//"/peer <origin>\n" on the client port and, once the peer answered
+//"peer ok\n", forwards the messages of its own clients as batched binary
+//frames. Links only carry a server's own messages, so with a full mesh
+//every message crosses exactly one link per peer and nothing is relayed.
+//
+//Frame: origin (u32), first sequence number (u32), record count (u16),
+//then per record room name length (u8), text length (u16), room name and
+//text. All integers in network byte order. The lobby has an empty name.
+//
+//The origin id is picked at random on startup, so a restarted server is a
+//new origin and its sequence numbers never collide with the old ones.
+enum LinkKind : uint8_t { not_a_link = 0, inbound_link, outbound_link };
+
+struct PeerAddress {
+    std::string name;   //as given on the command line
+    struct sockaddr_in addr;
+};
+
+//"host:port", resolved once at startup.
+inline bool parse_peer(const std::string &text, PeerAddress &peer) {
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos)
+        return false;
+    struct addrinfo hints, *found;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(text.substr(0, colon).c_str(), text.c_str() + colon + 1, &hints, &found) != 0)
+        return false;
+    peer.name = text;
+    memcpy(&peer.addr, found->ai_addr, sizeof(peer.addr));
+    freeaddrinfo(found);
+    return true;
+}
+
+//Collects the messages of one loop iteration into a frame.
+class FrameEncoder {
+public:
+    enum { header_size = 10, max_frame = 32768, max_records = 65535 };
+
+    FrameEncoder() : next_seq_(1), first_seq_(1), count_(0) {}
+
+    bool empty() const { return count_ == 0; }
+
+    //Room for one more maximal record? Otherwise send the frame first.
+    bool full() const {
+        return count_ == max_records || records_.size() + 3 + 255 + LineFramer::max_message_length > max_frame;
+    }
+
+    void add(const std::string &room, const struct iovec *parts, int count) {
+        size_t length = 0;
+        for (int i = 0; i < count; ++i)
+            length += parts[i].iov_len;
+        put8(room.size());
+        put16(length);
+        records_ += room;
+        for (int i = 0; i < count; ++i)
+            records_.append(static_cast<const char *>(parts[i].iov_base), parts[i].iov_len);
+        ++count_;
+        ++next_seq_;
+    }
+
+    //The finished frame as two iovecs, valid until clear().
+    void frame(uint32_t origin, struct iovec iov[2]) {
+        uint32_t value = htonl(origin);
+        memcpy(header_, &value, 4);
+        value = htonl(first_seq_);
+        memcpy(header_ + 4, &value, 4);
+        uint16_t records = htons(count_);
+        memcpy(header_ + 8, &records, 2);
+        iov[0].iov_base = header_;
+        iov[0].iov_len = header_size;
+        iov[1].iov_base = &records_[0];
+        iov[1].iov_len = records_.size();
+    }
+
+    void clear() {
+        records_.clear();
+        first_seq_ = next_seq_;
+        count_ = 0;
+    }
+
+private:
+    void put8(uint8_t value) { records_ += char(value); }
+    void put16(uint16_t value) {
+        value = htons(value);
+        records_.append(reinterpret_cast<const char *>(&value), 2);
+    }
+
+    char header_[header_size];
+    std::string records_;
+    uint32_t next_seq_, first_seq_;
+    uint16_t count_;
+};
+
+//Takes frames apart as they arrive. Records are consumed one by one, so a
+//frame never has to fit into the input ring as a whole.
+class FrameDecoder {
+public:
+    FrameDecoder() : origin_(0), seq_(0), remaining_(0) {}
+
+    //Calls on_message(origin, seq, room, parts, count) for every complete
+    //record in `input`. False on malformed data.
+    template <class Handler>
+    bool decode(LineFramer &input, Handler on_message) {
+        while (true) {
+            if (remaining_ == 0) {
+                unsigned char header[FrameEncoder::header_size];
+                if (!peek(input, header, sizeof(header)))
+                    return true;
+                input.consume(sizeof(header));
+                origin_ = get32(header);
+                seq_ = get32(header + 4);
+                remaining_ = get16(header + 8);
+                continue;
+            }
+
+            unsigned char header[3];
+            if (!peek(input, header, sizeof(header)))
+                return true;
+            size_t room_length = header[0];
+            size_t length = get16(header + 1);
+            if (length > LineFramer::max_message_length)
+                return false;
+            if (input.size() < sizeof(header) + room_length + length)
+                return true;
+            input.consume(sizeof(header));
+
+            char room[256];
+            peek(input, room, room_length);
+            input.consume(room_length);
+
+            struct iovec parts[2];
+            int count = input.data(length, parts);
+            on_message(origin_, seq_, std::string(room, room_length), parts, count);
+            input.consume(length);
+            ++seq_;
+            --remaining_;
+        }
+    }
+
+private:
+    static bool peek(const LineFramer &input, void *to, size_t length) {
+        if (input.size() < length)
+            return false;
+        struct iovec parts[2];
+        int count = input.data(length, parts);
+        char *out = static_cast<char *>(to);
+        for (int i = 0; i < count; ++i) {
+            memcpy(out, parts[i].iov_base, parts[i].iov_len);
+            out += parts[i].iov_len;
+        }
+        return true;
+    }
+
+    static uint32_t get32(const unsigned char *from) {
+        uint32_t value;
+        memcpy(&value, from, 4);
+        return ntohl(value);
+    }
+
+    static uint16_t get16(const unsigned char *from) {
+        uint16_t value;
+        memcpy(&value, from, 2);
+        return ntohs(value);
+    }
+
+    uint32_t origin_, seq_;
+    uint16_t remaining_;
+};
+
+//Drops messages seen before. Each origin numbers its messages, and frames
+//from one origin arrive in order on any one link, so the highest number
+//seen per origin is enough even if an origin reaches us over two links.
+class OriginFilter {
+public:
+    explicit OriginFilter(uint32_t self) : self_(self) {}
+
+    bool accept(uint32_t origin, uint32_t seq) {
+        if (origin == self_)
+            return false;
+        auto found = last_.find(origin);
+        if (found == last_.end()) {
+            last_[origin] = seq;
+            return true;
+        }
+        if (int32_t(seq - found->second) <= 0)
+            return false;
+        found->second = seq;
+        return true;
+    }
+
+private:
+    uint32_t self_;
+    std::unordered_map<uint32_t, uint32_t> last_;
+};
+
+#endif //CHATSRV_FEDERATION_H
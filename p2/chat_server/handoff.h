@@ -0,0 +1,204 @@
+#ifndef CHATSRV_HANDOFF_H
+#define CHATSRV_HANDOFF_H
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//Hot restart. A server started with -H <path> listens on a Unix socket
+//there. A new server started with the same path connects to it, wakes the
+//old one with SIGUSR2 and receives the listening socket and every client
+//connection over SCM_RIGHTS, together with what is needed to carry on:
+//room, mode, unprocessed input and unsent output. The old server exits
+//without closing anything on the clients' side.
+//
+//Stream: batches of a header (fd count, payload bytes), sent with the fds
+//attached, followed by the payload: per fd a record of flags (u8), room
+//name length (u8), input length (u32), output length (u32) and the three
+//byte strings. The first batch holds only the listening socket, a batch
+//with no fds ends the stream.
+struct HandoffClient {
+    int fd;
+    bool binary;
+    std::string room;
+    std::string input;   //received, not yet handled
+    std::string output;  //not yet sent
+};
+
+class Handoff {
+public:
+    enum { max_batch = 250 }; //below the kernel's SCM_MAX_FD
+
+    //Old side: the connection from the new server on the control socket.
+    static bool send_listener(int control, int listener) {
+        return send_batch(control, &listener, 1, std::string());
+    }
+
+    static bool send_clients(int control, const std::vector<HandoffClient> &clients) {
+        for (size_t first = 0; first < clients.size(); first += max_batch) {
+            size_t last = std::min(clients.size(), first + size_t(max_batch));
+            std::vector<int> fds;
+            std::string payload;
+            for (size_t i = first; i < last; ++i) {
+                const HandoffClient &client = clients[i];
+                fds.push_back(client.fd);
+                payload += char(client.binary ? 1 : 0);
+                payload += char(client.room.size());
+                put32(payload, client.input.size());
+                put32(payload, client.output.size());
+                payload += client.room;
+                payload += client.input;
+                payload += client.output;
+            }
+            if (!send_batch(control, fds.data(), fds.size(), payload))
+                return false;
+        }
+        return send_batch(control, nullptr, 0, std::string());
+    }
+
+    //New side. Returns the listening socket or -1.
+    static int receive_listener(int control) {
+        std::vector<int> fds;
+        std::string payload;
+        if (!receive_batch(control, fds, payload) || fds.size() != 1)
+            return -1;
+        return fds[0];
+    }
+
+    static bool receive_clients(int control, std::vector<HandoffClient> &clients) {
+        while (true) {
+            std::vector<int> fds;
+            std::string payload;
+            if (!receive_batch(control, fds, payload))
+                return false;
+            if (fds.empty())
+                return true;
+            size_t offset = 0;
+            for (int fd : fds) {
+                if (offset + 10 > payload.size())
+                    return false;
+                HandoffClient client;
+                client.fd = fd;
+                client.binary = payload[offset];
+                size_t room = static_cast<unsigned char>(payload[offset + 1]);
+                size_t input = get32(payload, offset + 2);
+                size_t output = get32(payload, offset + 6);
+                offset += 10;
+                if (offset + room + input + output > payload.size())
+                    return false;
+                client.room = payload.substr(offset, room);
+                client.input = payload.substr(offset + room, input);
+                client.output = payload.substr(offset + room + input, output);
+                offset += room + input + output;
+                clients.push_back(std::move(client));
+            }
+        }
+    }
+
+    static bool set_path(const std::string &path, struct sockaddr_un &addr) {
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path))
+            return false;
+        memcpy(addr.sun_path, path.data(), path.size());
+        return true;
+    }
+
+private:
+    static void put32(std::string &to, uint32_t value) {
+        to.append(reinterpret_cast<const char *>(&value), sizeof(value));
+    }
+
+    static uint32_t get32(const std::string &from, size_t offset) {
+        uint32_t value;
+        memcpy(&value, from.data() + offset, sizeof(value));
+        return value;
+    }
+
+    static bool send_batch(int control, const int *fds, size_t count, const std::string &payload) {
+        uint32_t header[2] = { uint32_t(count), uint32_t(payload.size()) };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        struct iovec io = { header, sizeof(header) };
+        msg.msg_iov = &io;
+        msg.msg_iovlen = 1;
+        std::vector<char> control_data(CMSG_SPACE(sizeof(int) * max_batch));
+        if (count > 0) {
+            msg.msg_control = control_data.data();
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+            struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            cmsg->cmsg_level = SOL_SOCKET;
+            cmsg->cmsg_type = SCM_RIGHTS;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+            memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+        }
+        if (sendmsg(control, &msg, 0) != sizeof(header))
+            return false;
+        return write_all(control, payload.data(), payload.size());
+    }
+
+    //The fds arrive with the first byte of the header, so the header is
+    //read with recvmsg and the payload with plain reads.
+    static bool receive_batch(int control, std::vector<int> &fds, std::string &payload) {
+        uint32_t header[2];
+        std::vector<char> control_data(CMSG_SPACE(sizeof(int) * max_batch));
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        struct iovec io = { header, sizeof(header) };
+        msg.msg_iov = &io;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control_data.data();
+        msg.msg_controllen = control_data.size();
+        ssize_t received = recvmsg(control, &msg, MSG_WAITALL);
+        if (received != sizeof(header))
+            return false;
+        for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            const int *data = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+            fds.insert(fds.end(), data, data + count);
+        }
+        if (fds.size() != header[0])
+            return false;
+        payload.resize(header[1]);
+        return read_all(control, &payload[0], payload.size());
+    }
+
+    static bool write_all(int fd, const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t result = write(fd, data, size);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                return false;
+            data += result;
+            size -= result;
+        }
+        return true;
+    }
+
+    static bool read_all(int fd, char *data, size_t size) {
+        while (size > 0) {
+            ssize_t result = read(fd, data, size);
+            if (result < 0 && errno == EINTR)
+                continue;
+            if (result <= 0)
+                return false;
+            data += result;
+            size -= result;
+        }
+        return true;
+    }
+};
+
+#endif //CHATSRV_HANDOFF_H
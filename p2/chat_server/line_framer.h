@@ -0,0 +1,138 @@
+#ifndef CHATSRV_LINE_FRAMER_H
+#define CHATSRV_LINE_FRAMER_H
+
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "ring_buffer.h"
+
+//Per-connection input ring. Data is read straight into the free space and
+//complete lines are handed out as (at most two) iovecs pointing into the ring,
+//so a message is never copied between recv and send.
+//
+//Clients that negotiated binary mode send frames instead of lines: a
+//varint length (LEB128, 7 bits per byte, low bits first) and that many
+//bytes. Frames are sliced off by their length without scanning the text.
+class LineFramer {
+public:
+    enum {
+        max_message_length = 1024,
+        capacity = 2048 //must hold a full message plus one recv
+    };
+
+    size_t size() const { return ring_.size(); }
+    bool empty() const { return ring_.empty(); }
+    size_t room() const { return ring_.room(); }
+
+    //Read as much as fits into the free space. Returns the readv() result.
+    ssize_t read_from(int fd) { return ring_.read_from(fd); }
+
+    //Raw access for binary protocols.
+    int data(size_t length, struct iovec parts[2]) const { return ring_.data(length, parts); }
+    void consume(size_t length) { ring_.consume(length); }
+
+    //For backends that receive into their own buffers. length <= room().
+    void append(const char *data, size_t length) {
+        struct iovec part = { const_cast<char *>(data), length };
+        ring_.append(&part, 1);
+    }
+
+    //Calls on_line(parts, count) for every complete message, without the
+    //trailing '\n'. Lines longer than max_message_length are cut into
+    //max_message_length pieces, each of which is a message of its own.
+    //If on_line returns false the message is left in the ring and
+    //extraction stops.
+    template <class Handler>
+    void extract(Handler on_line) {
+        while (!empty()) {
+            size_t window = size();
+            if (window > max_message_length + 1)
+                window = max_message_length + 1;
+
+            size_t length = find_newline(window);
+            size_t consumed = length + 1;
+            if (length == window) {
+                if (size() <= max_message_length)
+                    return; //incomplete line, wait for more data
+                length = consumed = max_message_length;
+            }
+
+            struct iovec parts[2];
+            if (!on_line(parts, ring_.data(length, parts)))
+                return;
+            ring_.consume(consumed);
+        }
+    }
+
+    //Calls on_line(parts, count) for every complete frame, with the same
+    //contract as extract(). False if a frame is malformed or longer than
+    //max_message_length.
+    template <class Handler>
+    bool extract_frames(Handler on_frame) {
+        while (!empty()) {
+            unsigned char prefix[max_varint];
+            size_t available = size();
+            if (available > max_varint)
+                available = max_varint;
+            struct iovec parts[2];
+            int count = ring_.data(available, parts);
+            size_t copied = 0;
+            for (int i = 0; i < count; ++i) {
+                memcpy(prefix + copied, parts[i].iov_base, parts[i].iov_len);
+                copied += parts[i].iov_len;
+            }
+
+            size_t length = 0, header = 0;
+            while (true) {
+                if (header == available)
+                    return available < max_varint; //wait for the rest of the prefix
+                length |= size_t(prefix[header] & 0x7f) << (7 * header);
+                if (!(prefix[header++] & 0x80))
+                    break;
+            }
+            if (length > max_message_length)
+                return false;
+            if (size() < header + length)
+                return true;
+
+            if (!on_frame(parts, ring_.data(header, length, parts)))
+                return true;
+            ring_.consume(header + length);
+        }
+        return true;
+    }
+
+private:
+    enum { max_varint = 2 }; //enough for max_message_length
+
+    //Offset of the first '\n' among the first `window` bytes, or `window`.
+    //memchr is vectorized by libc, so the scan runs at memory bandwidth.
+    size_t find_newline(size_t window) const {
+        struct iovec parts[2];
+        int count = ring_.data(window, parts);
+        size_t offset = 0;
+        for (int i = 0; i < count; ++i) {
+            const char *found = static_cast<const char *>(memchr(parts[i].iov_base, '\n', parts[i].iov_len));
+            if (found)
+                return offset + (found - static_cast<const char *>(parts[i].iov_base));
+            offset += parts[i].iov_len;
+        }
+        return window;
+    }
+
+    RingBuffer<capacity> ring_;
+};
+
+//Writes the varint prefix for a binary frame, returns its length.
+inline size_t encode_varint(size_t value, unsigned char *out) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = static_cast<unsigned char>(value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = static_cast<unsigned char>(value);
+    return length;
+}
+
+#endif //CHATSRV_LINE_FRAMER_H
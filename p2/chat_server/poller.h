@@ -0,0 +1,122 @@
+#ifndef CHATSRV_POLLER_H
+#define CHATSRV_POLLER_H
+
+#include <system_error>
+
+#include <errno.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+struct PollEvent {
+    int fd;
+    bool readable;  //also set on hangup/error, the following read reports it
+    bool writable;
+    bool hangup;    //hangup/error, reported even without read interest
+};
+
+//Readiness notification: epoll on Linux, kqueue on Mac OS X / BSD.
+//Descriptors start with read interest only; close() unregisters them.
+class Poller {
+public:
+    enum { max_events = 256 };
+
+    Poller();
+    ~Poller() { ::close(fd_); }
+    Poller(const Poller &) = delete;
+    Poller &operator=(const Poller &) = delete;
+
+    void add(int fd);
+    void set_interest(int fd, bool read, bool write);
+
+    //Wait for at most timeout_ms (-1 blocks). Returns the number of events.
+    int wait(int timeout_ms);
+    const PollEvent &event(int i) const { return events_[i]; }
+
+private:
+    int fd_;
+    PollEvent events_[max_events];
+};
+
+#if defined(__linux__)
+
+inline Poller::Poller() : fd_(epoll_create1(EPOLL_CLOEXEC)) {
+    if (fd_ == -1)
+        throw std::system_error(errno, std::system_category());
+}
+
+inline void Poller::add(int fd) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = fd;
+    epoll_ctl(fd_, EPOLL_CTL_ADD, fd, &ev);
+}
+
+inline void Poller::set_interest(int fd, bool read, bool write) {
+    struct epoll_event ev;
+    ev.events = 0;
+    if (read)
+        ev.events |= EPOLLIN;
+    if (write)
+        ev.events |= EPOLLOUT;
+    ev.data.fd = fd;
+    epoll_ctl(fd_, EPOLL_CTL_MOD, fd, &ev);
+}
+
+inline int Poller::wait(int timeout_ms) {
+    struct epoll_event raw[max_events];
+    int count = epoll_wait(fd_, raw, max_events, timeout_ms);
+    for (int i = 0; i < count; ++i) {
+        events_[i].fd = raw[i].data.fd;
+        events_[i].readable = raw[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR);
+        events_[i].writable = raw[i].events & EPOLLOUT;
+        events_[i].hangup = raw[i].events & (EPOLLHUP | EPOLLERR);
+    }
+    return count < 0 ? 0 : count;
+}
+
+#else
+
+inline Poller::Poller() : fd_(kqueue()) {
+    if (fd_ == -1)
+        throw std::system_error(errno, std::system_category());
+}
+
+inline void Poller::add(int fd) {
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, EV_ADD, 0, 0, 0);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, EV_ADD | EV_DISABLE, 0, 0, 0);
+    kevent(fd_, changes, 2, NULL, 0, NULL);
+}
+
+inline void Poller::set_interest(int fd, bool read, bool write) {
+    struct kevent changes[2];
+    EV_SET(&changes[0], fd, EVFILT_READ, read ? EV_ENABLE : EV_DISABLE, 0, 0, 0);
+    EV_SET(&changes[1], fd, EVFILT_WRITE, write ? EV_ENABLE : EV_DISABLE, 0, 0, 0);
+    kevent(fd_, changes, 2, NULL, 0, NULL);
+}
+
+inline int Poller::wait(int timeout_ms) {
+    struct kevent raw[max_events];
+    struct timespec timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    int count = kevent(fd_, NULL, 0, raw, max_events, timeout_ms < 0 ? NULL : &timeout);
+    for (int i = 0; i < count; ++i) {
+        events_[i].fd = raw[i].ident;
+        events_[i].readable = raw[i].filter == EVFILT_READ;
+        events_[i].writable = raw[i].filter == EVFILT_WRITE;
+        events_[i].hangup = false;  //a disabled read filter reports nothing
+    }
+    return count < 0 ? 0 : count;
+}
+
+#endif
+
+#endif //CHATSRV_POLLER_H
@@ -0,0 +1,74 @@
+#ifndef CHATSRV_RATE_LIMITER_H
+#define CHATSRV_RATE_LIMITER_H
+
+#include <stdint.h>
+
+#include "connection_table.h"
+
+//Per-client token buckets for messages/s and bytes/s. The bucket state
+//lives in the Connection (two 64-bit counters and a timestamp); tokens are
+//kept in thousandths so that integer refills stay exact at low rates, and
+//a full bucket at any 32-bit rate still fits. A bucket holds one second
+//worth of tokens, and the byte bucket at least two maximal lines.
+//A rate of 0 disables that limit.
+class RateLimiter {
+public:
+    RateLimiter(unsigned msgs_per_s, unsigned bytes_per_s)
+    : msg_rate_(msgs_per_s), byte_rate_(bytes_per_s),
+      msg_burst_(uint64_t(msgs_per_s) * 1000),
+      byte_burst_(uint64_t(bytes_per_s > 2048 ? bytes_per_s : 2048) * 1000) {}
+
+    bool enabled() const { return msg_rate_ || byte_rate_; }
+
+    //Start with full buckets.
+    void reset(Connection *conn, uint32_t now) {
+        conn->msg_tokens = msg_burst_;
+        conn->byte_tokens = byte_burst_;
+        conn->tokens_ms = now;
+    }
+
+    //Take the tokens for one message of `bytes`, or nothing at all.
+    bool take(Connection *conn, uint32_t now, size_t bytes) {
+        refill(conn, now);
+        uint64_t bytes_cost = uint64_t(bytes) * 1000;
+        if ((msg_rate_ && conn->msg_tokens < 1000) || (byte_rate_ && conn->byte_tokens < bytes_cost))
+            return false;
+        if (msg_rate_)
+            conn->msg_tokens -= 1000;
+        if (byte_rate_)
+            conn->byte_tokens -= bytes_cost;
+        return true;
+    }
+
+    //How long until take(conn, bytes) can succeed.
+    uint32_t wait_ms(const Connection *conn, size_t bytes) const {
+        uint32_t wait = 0;
+        if (msg_rate_ && conn->msg_tokens < 1000)
+            wait = (1000 - conn->msg_tokens + msg_rate_ - 1) / msg_rate_;
+        uint64_t bytes_cost = uint64_t(bytes) * 1000;
+        if (byte_rate_ && conn->byte_tokens < bytes_cost) {
+            uint32_t byte_wait = (bytes_cost - conn->byte_tokens + byte_rate_ - 1) / byte_rate_;
+            if (byte_wait > wait)
+                wait = byte_wait;
+        }
+        return wait;
+    }
+
+private:
+    //rate per second is rate thousandths per ms.
+    void refill(Connection *conn, uint32_t now) {
+        uint32_t elapsed = now - conn->tokens_ms;
+        conn->tokens_ms = now;
+        conn->msg_tokens = fill(conn->msg_tokens, uint64_t(elapsed) * msg_rate_, msg_burst_);
+        conn->byte_tokens = fill(conn->byte_tokens, uint64_t(elapsed) * byte_rate_, byte_burst_);
+    }
+
+    static uint64_t fill(uint64_t tokens, uint64_t added, uint64_t burst) {
+        return tokens + added > burst ? burst : tokens + added;
+    }
+
+    uint32_t msg_rate_, byte_rate_;
+    uint64_t msg_burst_, byte_burst_;
+};
+
+#endif //CHATSRV_RATE_LIMITER_H
@@ -0,0 +1,197 @@
+#ifndef CHATSRV_READINESS_LOOP_H
+#define CHATSRV_READINESS_LOOP_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "poller.h"
+
+#ifndef MSG_HAVEMORE
+#define MSG_HAVEMORE 0
+#endif
+
+int set_nonblock(int fd);
+
+//epoll/kqueue backend: wait for readiness, then read or write. Input is
+//read straight into the client's ring and messages go out with a direct
+//sendmsg; only what the socket does not take is copied to the output ring.
+class ReadinessLoop : public EventLoop {
+public:
+    ReadinessLoop(ConnectionTable &clients, EventHandler &handler, int master_socket)
+    : EventLoop(clients, handler), master_socket_(master_socket) {
+        poller_.add(master_socket_);
+    }
+
+    const char *name() const { return "epoll/kqueue"; }
+
+    void poll(int timeout_ms) {
+        int count = poller_.wait(timeout_ms);
+        ++syscalls_;
+        for (int i = 0; i < count; ++i) {
+            const PollEvent &event = poller_.event(i);
+            if (event.fd == master_socket_) {
+                accept_clients();
+                continue;
+            }
+            Connection *conn = clients_.find(event.fd);
+            if (!conn || conn->closing)
+                continue;
+            if (event.writable)
+                handle_write(conn);
+            if (conn->closing)
+                continue;
+            //epoll reports a hangup whatever the interest; left alone on a
+            //paused client it would come back on every wait.
+            if (event.hangup && (conn->io_flags & read_paused))
+                handler_.on_hangup(conn);
+            else if (event.readable && !(conn->io_flags & read_paused))
+                handle_read(conn);
+        }
+    }
+
+    Connection *connect(const struct sockaddr_in *addr) {
+        int Socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        ++syscalls_;
+        if (Socket == -1)
+            return nullptr;
+        set_nonblock(Socket);
+        int Result = ::connect(Socket, (const struct sockaddr *)addr, sizeof(*addr));
+        syscalls_ += 3;
+        if (Result == -1 && errno != EINPROGRESS) {
+            ::close(Socket);
+            return nullptr;
+        }
+        //Until the connection is up, sends fail with EAGAIN and get queued.
+        poller_.add(Socket);
+        ++syscalls_;
+        return clients_.add(Socket);
+    }
+
+    Connection *adopt(int fd) {
+        set_nonblock(fd);
+        poller_.add(fd);
+        syscalls_ += 3;
+        return clients_.add(fd);
+    }
+
+    bool send(Connection *conn, struct iovec *iov, int count) {
+        if (!conn->output) {
+            struct msghdr msg;
+            bzero(&msg, sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = count;
+            ssize_t SentSize = sendmsg(conn->fd, &msg, MSG_HAVEMORE);
+            ++syscalls_;
+            if (SentSize < 0 && errno != EAGAIN && errno != EINTR) {
+                handler_.on_hangup(conn);
+                return true;
+            }
+            while (count > 0 && SentSize >= static_cast<ssize_t>(iov->iov_len)) {
+                SentSize -= iov->iov_len;
+                ++iov;
+                --count;
+            }
+            if (count == 0)
+                return true;
+            if (SentSize > 0) {
+                iov->iov_base = static_cast<char *>(iov->iov_base) + SentSize;
+                iov->iov_len -= SentSize;
+            }
+            clients_.output(conn);
+            poller_.set_interest(conn->fd, !(conn->io_flags & read_paused), true);
+            ++syscalls_;
+            handler_.on_output(conn);
+        }
+        return clients_.output(conn).append(iov, count);
+    }
+
+    void pause_reads(Connection *conn) {
+        conn->io_flags |= read_paused;
+        poller_.set_interest(conn->fd, false, conn->output != nullptr);
+        ++syscalls_;
+    }
+
+    void resume_reads(Connection *conn) {
+        conn->io_flags &= ~read_paused;
+        poller_.set_interest(conn->fd, true, conn->output != nullptr);
+        ++syscalls_;
+    }
+
+    void close(Connection *conn) {
+        ::close(conn->fd);
+        ++syscalls_;
+        clients_.remove(conn);
+    }
+
+private:
+    enum : uint8_t { read_paused = 1 };
+
+    //Drain the backlog up to the batch limit. The listening socket is
+    //level-triggered, so whatever is left is reported again next time.
+    void accept_clients() {
+        for (unsigned i = 0; i < accept_batch_; ++i) {
+#if defined(__linux__)
+            int SlaveSocket = accept4(master_socket_, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            ++syscalls_;
+#else
+            int SlaveSocket = accept(master_socket_, 0, 0);
+            ++syscalls_;
+            if (SlaveSocket != -1) {
+                set_nonblock(SlaveSocket);
+                syscalls_ += 2;
+            }
+#endif
+            if (SlaveSocket == -1)
+                return;
+            if (!admit()) {
+                ::close(SlaveSocket);
+                ++syscalls_;
+                ++rejected_;
+                continue;
+            }
+            poller_.add(SlaveSocket);
+            ++syscalls_;
+            handler_.on_accept(clients_.add(SlaveSocket));
+        }
+    }
+
+    void handle_read(Connection *conn) {
+        LineFramer &framer = clients_.input(conn);
+        ssize_t RecvSize = framer.read_from(conn->fd);
+        ++syscalls_;
+        if (RecvSize < 0 && (errno == EAGAIN || errno == EINTR))
+            return;
+        if (RecvSize <= 0) {
+            handler_.on_hangup(conn);
+            return;
+        }
+        handler_.on_input(conn);
+    }
+
+    void handle_write(Connection *conn) {
+        OutputBuffer &output = clients_.output(conn);
+        ssize_t SentSize = output.write_to(conn->fd);
+        ++syscalls_;
+        if (SentSize < 0 && errno != EAGAIN && errno != EINTR) {
+            handler_.on_hangup(conn);
+            return;
+        }
+        if (SentSize > 0)
+            handler_.on_output(conn);
+        if (output.empty()) {
+            clients_.release_output(conn);
+            poller_.set_interest(conn->fd, !(conn->io_flags & read_paused), false);
+            ++syscalls_;
+        }
+    }
+
+    int master_socket_;
+    Poller poller_;
+};
+
+#endif //CHATSRV_READINESS_LOOP_H
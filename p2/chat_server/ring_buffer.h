@@ -0,0 +1,109 @@
+#ifndef CHATSRV_RING_BUFFER_H
+#define CHATSRV_RING_BUFFER_H
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+//Fixed-capacity byte ring. Both the pending data and the free space are
+//exposed as (at most two) iovecs, so sockets read into and write out of it
+//directly with readv/writev.
+template <size_t Capacity>
+class RingBuffer {
+    static_assert((Capacity & (Capacity - 1)) == 0, "capacity must be a power of two");
+public:
+    enum { capacity = Capacity };
+
+    RingBuffer() : head_(0), tail_(0) {}
+
+    size_t size() const { return tail_ - head_; }
+    size_t room() const { return capacity - size(); }
+    bool empty() const { return head_ == tail_; }
+
+    //Describe the first `length` pending bytes.
+    int data(size_t length, struct iovec parts[2]) const {
+        return segments(head_, length, parts);
+    }
+
+    //Describe `length` pending bytes starting `offset` bytes in.
+    int data(size_t offset, size_t length, struct iovec parts[2]) const {
+        return segments(head_ + offset, length, parts);
+    }
+
+    int space(struct iovec parts[2]) {
+        return segments(tail_, room(), parts);
+    }
+
+    void commit(size_t length) { tail_ += length; }
+
+    void consume(size_t length) {
+        head_ += length;
+        if (head_ == tail_)
+            head_ = tail_ = 0;
+    }
+
+    //Copy a message in as a whole or not at all.
+    bool append(const struct iovec *parts, int count) {
+        size_t length = 0;
+        for (int i = 0; i < count; ++i)
+            length += parts[i].iov_len;
+        if (length > room())
+            return false;
+        for (int i = 0; i < count; ++i) {
+            const char *from = static_cast<const char *>(parts[i].iov_base);
+            size_t left = parts[i].iov_len;
+            while (left > 0) {
+                size_t start = tail_ & (capacity - 1);
+                size_t chunk = capacity - start < left ? capacity - start : left;
+                memcpy(buf_ + start, from, chunk);
+                tail_ += chunk;
+                from += chunk;
+                left -= chunk;
+            }
+        }
+        return true;
+    }
+
+    ssize_t read_from(int fd) {
+        struct iovec iov[2];
+        int count = space(iov);
+        if (count == 0)
+            return 0;
+        ssize_t result = readv(fd, iov, count);
+        if (result > 0)
+            commit(result);
+        return result;
+    }
+
+    ssize_t write_to(int fd) {
+        struct iovec iov[2];
+        int count = data(size(), iov);
+        if (count == 0)
+            return 0;
+        ssize_t result = writev(fd, iov, count);
+        if (result > 0)
+            consume(result);
+        return result;
+    }
+
+private:
+    int segments(uint32_t from, size_t length, struct iovec parts[2]) const {
+        if (length == 0)
+            return 0;
+        size_t start = from & (capacity - 1);
+        size_t first = capacity - start < length ? capacity - start : length;
+        parts[0].iov_base = const_cast<char *>(buf_ + start);
+        parts[0].iov_len = first;
+        if (first == length)
+            return 1;
+        parts[1].iov_base = const_cast<char *>(buf_);
+        parts[1].iov_len = length - first;
+        return 2;
+    }
+
+    uint32_t head_, tail_;
+    char buf_[Capacity];
+};
+
+#endif //CHATSRV_RING_BUFFER_H
@@ -0,0 +1,102 @@
+#ifndef CHATSRV_ROOM_TABLE_H
+#define CHATSRV_ROOM_TABLE_H
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "connection_table.h"
+
+//Named rooms with a dense member array each, so a broadcast walks only the
+//members of one room. Every client is in exactly one room; new clients and
+//clients that leave a room are in the lobby. Empty rooms are recycled.
+class RoomTable {
+public:
+    enum : uint32_t { lobby = 0 };
+
+    RoomTable() {
+        rooms_.emplace_back();
+    }
+
+    uint32_t find_or_create(const std::string &name) {
+        auto found = by_name_.find(name);
+        if (found != by_name_.end())
+            return found->second;
+
+        uint32_t room;
+        if (free_.empty()) {
+            room = rooms_.size();
+            rooms_.emplace_back();
+        }
+        else {
+            room = free_.back();
+            free_.pop_back();
+        }
+        rooms_[room].name = name;
+        by_name_[name] = room;
+        return room;
+    }
+
+    //Existing rooms only; the lobby has an empty name.
+    bool find(const std::string &name, uint32_t &room) const {
+        if (name.empty()) {
+            room = lobby;
+            return true;
+        }
+        auto found = by_name_.find(name);
+        if (found == by_name_.end())
+            return false;
+        room = found->second;
+        return true;
+    }
+
+    //Move the client from its current room (if any) to `room`. Joining the
+    //room the client is in keeps it there; leaving first would recycle the
+    //room under it if the client were its only member.
+    void join(Connection *conn, uint32_t room) {
+        if (conn->in_room && conn->room == room)
+            return;
+        if (conn->in_room)
+            leave(conn);
+        std::vector<Connection *> &members = rooms_[room].members;
+        conn->room = room;
+        conn->room_index = members.size();
+        conn->in_room = true;
+        members.push_back(conn);
+    }
+
+    void leave(Connection *conn) {
+        if (!conn->in_room)
+            return;
+        Room &room = rooms_[conn->room];
+        Connection *last = room.members.back();
+        room.members[conn->room_index] = last;
+        last->room_index = conn->room_index;
+        room.members.pop_back();
+        conn->in_room = false;
+
+        if (room.members.empty() && conn->room != lobby) {
+            by_name_.erase(room.name);
+            room.name.clear();
+            room.members.shrink_to_fit();
+            free_.push_back(conn->room);
+        }
+    }
+
+    const std::vector<Connection *> &members(uint32_t room) const { return rooms_[room].members; }
+    const std::string &name(uint32_t room) const { return rooms_[room].name; }
+    size_t size() const { return by_name_.size() + 1; }
+
+private:
+    struct Room {
+        std::string name;
+        std::vector<Connection *> members;
+    };
+
+    std::vector<Room> rooms_;
+    std::vector<uint32_t> free_;
+    std::unordered_map<std::string, uint32_t> by_name_;
+};
+
+#endif //CHATSRV_ROOM_TABLE_H
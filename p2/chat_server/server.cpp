@@ -1,21 +1,37 @@
+//Architecture: Linux (epoll, optionally io_uring) and Mac OS X (kqueue).
+
 #include <iostream>
 #include <algorithm>
-#include <set>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <poll.h>
-
-#include <sys/event.h>
+#include <time.h>
 
 #include <errno.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <string.h>
 
-#include <set>
-#include <map>
+#include "async_log.h"
+#include "connection_table.h"
+#include "event_loop.h"
+#include "federation.h"
+#include "handoff.h"
+#include "rate_limiter.h"
+#include "readiness_loop.h"
+#include "room_table.h"
+#include "timer_wheel.h"
+#include "uring_loop.h"
 
 int set_nonblock(int fd) {
     int flags;
@@ -29,93 +45,814 @@ int set_nonblock(int fd) {
 #endif
 }
 
-void logstr(std::string line) {
-    std::cout << line << std::endl;
+//Log output is written to stdout by a background thread, see async_log.h.
+AsyncLog &server_log() {
+    static AsyncLog Log(STDOUT_FILENO);
+    return Log;
 }
 
-int main(int argc, char **argv) {
-    int MasterSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    
-    if(MasterSocket == -1) {
-        std::cout << strerror(errno) << std::endl;
-        return 1;
+//Connection events are required by the tests and are never dropped.
+void logstr(const std::string &line) {
+    server_log().write(line, true);
+}
+
+void logparts(const struct iovec *parts, int count) {
+    server_log().write(parts, count);
+}
+
+uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return uint64_t(ts.tv_sec) * 1000 + ts.tv_nsec / 1000000;
+}
+
+static volatile sig_atomic_t StatsRequested = 0;
+
+void request_stats(int) {
+    StatsRequested = 1;
+}
+
+//Sent by a new server that wants to take over, see handoff.h.
+static volatile sig_atomic_t HandoffRequested = 0;
+
+void request_handoff(int) {
+    HandoffRequested = 1;
+}
+
+struct Options {
+    unsigned idle_timeout_ms = 300 * 1000;   //no input from the client
+    unsigned write_timeout_ms = 30 * 1000;   //pending output, no progress
+    unsigned housekeeping_ms = 30 * 1000;
+    unsigned tick_ms = 100;
+    unsigned peer_retry_ms = 1000;           //redial a lost peer link
+    unsigned msgs_per_s = 0;                 //per-client input limits, 0 is off
+    unsigned bytes_per_s = 0;
+    unsigned accept_batch = 256;             //accepts per wakeup
+    unsigned max_connections = 0;            //0 is no limit
+    bool io_uring = false;
+    unsigned short port = 3100;
+    std::vector<PeerAddress> peers;
+    std::string handoff_path;                //hot restart control socket
+};
+
+//The chat logic. All socket I/O goes through an EventLoop backend, which
+//calls back here when clients connect, send data or make write progress.
+class ChatServer : public EventHandler {
+public:
+    enum { max_room_name = 64 };
+
+    //control_socket is the listening hot restart socket or -1.
+    ChatServer(int master_socket, int control_socket, const Options &options)
+    : options_(options), master_socket_(master_socket), control_socket_(control_socket),
+      now_(now_ms()), timers_(now_, options.tick_ms),
+      limiter_(options.msgs_per_s, options.bytes_per_s), origin_(random_origin()),
+      seen_(origin_), links_(options.peers.size()), delivered_(0), dropped_slow_(0), dropped_idle_(0),
+      throttled_(0), frames_sent_(0), received_(0), restoring_(false) {
+        loop_ = make_loop(master_socket);
+        loop_->set_admission(options_.accept_batch, options_.max_connections);
+        timers_.schedule(&housekeeping_, now_ + options_.housekeeping_ms);
+        for (size_t i = 0; i < links_.size(); ++i) {
+            links_[i].address = options_.peers[i];
+            connect_peer(links_[i]);
+        }
     }
-    
-    int enable = 1;
-    if (setsockopt(MasterSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
-        std::cout << "setsockopt(SO_REUSEADDR) failed" << std::endl;
-    
-    struct sockaddr_in SockAddr;
-    SockAddr.sin_family = AF_INET;
-    SockAddr.sin_port = htons(3100);
-    SockAddr.sin_addr.s_addr = INADDR_ANY;
 
-    
-    int Result = bind(MasterSocket, (struct sockaddr *)&SockAddr, sizeof(SockAddr));
-    
-    if(Result == -1) {
-        std::cout << strerror(errno) << std::endl;
-        return 1;
+    //Returns after the clients were handed to a new server.
+    void run() {
+        while (true) {
+            loop_->poll(timers_.next_timeout_ms(now_));
+            now_ = now_ms();
+            if (StatsRequested) {
+                StatsRequested = 0;
+                print_stats();
+            }
+            if (HandoffRequested) {
+                HandoffRequested = 0;
+                if (hand_off())
+                    return;
+            }
+
+            timers_.advance(now_, [this](TimerNode *node) { on_timer(node); });
+            reap();
+            flush_links();
+            loop_->flush();
+        }
     }
-    
-    set_nonblock(MasterSocket);
-    
-    Result = listen(MasterSocket, SOMAXCONN);
-    
-    if(Result == -1) {
-        std::cout << strerror(errno) << std::endl;
-        return 1;
+
+    //Carry on with the clients of the previous server. Output first, so
+    //that the replayed input is broadcast behind it and to everyone.
+    void restore(const std::vector<HandoffClient> &clients) {
+        std::vector<Connection *> adopted;
+        for (auto &client : clients) {
+            Connection *conn = loop_->adopt(client.fd);
+            rooms_.join(conn, client.room.empty() ? RoomTable::lobby : rooms_.find_or_create(client.room));
+            conn->binary = client.binary;
+            conn->last_read_ms = now_;
+            limiter_.reset(conn, now_);
+            arm_timer(conn);
+            if (!client.output.empty()) {
+                struct iovec iov = { const_cast<char *>(client.output.data()), client.output.size() };
+                if (!loop_->send(conn, &iov, 1))
+                    drop(conn, "output buffer overflow");
+            }
+            adopted.push_back(conn);
+        }
+
+        //Input may exceed the ring when the old server held some back, so
+        //it goes in as the backends feed it, and without the rate limit.
+        restoring_ = true;
+        for (size_t i = 0; i < clients.size(); ++i) {
+            Connection *conn = adopted[i];
+            const std::string &input = clients[i].input;
+            for (size_t used = 0; used < input.size() && !conn->closing;) {
+                LineFramer &framer = clients_.input(conn);
+                size_t chunk = std::min(input.size() - used, framer.room());
+                if (chunk == 0) {
+                    drop(conn, "input overflow");
+                    break;
+                }
+                framer.append(input.data() + used, chunk);
+                used += chunk;
+                on_input(conn);
+            }
+        }
+        restoring_ = false;
+        reap();
+        loop_->flush();
     }
-    
-    
-    int KQueue = kqueue();
-    
-    struct kevent KEvent;
-    bzero(&KEvent, sizeof(KEvent));
-    
-    EV_SET(&KEvent, MasterSocket, EVFILT_READ, EV_ADD, 0, 0, 0);
-    kevent(KQueue, &KEvent, 1, NULL, 0, NULL);
-    
-    auto clients = std::set<int>();
-    auto messages = std::map<int, std::string>();
-    
-    while(true) {
-        bzero(&KEvent, sizeof(KEvent));
-        kevent(KQueue, NULL, 0, &KEvent, 1, NULL);
-        
-        if(KEvent.filter == EVFILT_READ) {
-            if(KEvent.ident == MasterSocket) {
-                int SlaveSocket = accept(MasterSocket, 0, 0);
-                set_nonblock(SlaveSocket);
-                bzero(&KEvent, sizeof(KEvent));
-                EV_SET(&KEvent, SlaveSocket, EVFILT_READ, EV_ADD, 0, 0, 0);
-                kevent(KQueue, &KEvent, 1, NULL, 0, NULL);
-                clients.insert(SlaveSocket);
-                send(SlaveSocket, "Welcome\n", 8, MSG_HAVEMORE);
-                logstr("accepted connection");
+
+    void on_accept(Connection *conn) {
+        rooms_.join(conn, RoomTable::lobby);
+        conn->last_read_ms = now_;
+        limiter_.reset(conn, now_);
+        arm_timer(conn);
+
+        send_line(conn, "Welcome\n");
+        logstr("accepted connection");
+    }
+
+    void on_input(Connection *conn) {
+        LineFramer &framer = clients_.input(conn);
+        conn->last_read_ms = now_;
+        if (conn->link == inbound_link)
+            receive_frames(conn, framer);
+        else if (conn->link == outbound_link)
+            framer.extract([this, conn](const struct iovec *parts, int count) {
+                on_peer_reply(conn, parts, count);
+                return true;
+            });
+        else if (!conn->throttled && !process_lines(conn, framer))
+            throttle(conn);
+        if (framer.empty())
+            clients_.release_input(conn);
+    }
+
+    void on_hangup(Connection *conn) {
+        drop(conn, nullptr);
+    }
+
+    //Output was queued or went out. Starts the write-stall clock.
+    void on_output(Connection *conn) {
+        conn->last_write_ms = now_;
+        if (conn->link)
+            return;
+        if (conn->timer.expires * options_.tick_ms > now_ + options_.write_timeout_ms)
+            arm_timer(conn);
+    }
+
+private:
+    //Outgoing federation link to one configured peer.
+    struct PeerLink {
+        PeerAddress address;
+        Connection *conn = nullptr;
+        bool ready = false;     //peer answered the handshake
+        TimerNode retry;
+    };
+
+    //io_uring needs a recent Linux kernel; fall back to epoll without it.
+    std::unique_ptr<EventLoop> make_loop(int master_socket) {
+#if defined(__linux__)
+        if (options_.io_uring) {
+            try {
+                return std::unique_ptr<EventLoop>(new UringLoop(clients_, *this, master_socket));
+            }
+            catch (std::system_error &e) {
+                std::cerr << e.what() << ", using epoll" << std::endl;
             }
+        }
+#endif
+        return std::unique_ptr<EventLoop>(new ReadinessLoop(clients_, *this, master_socket));
+    }
+
+    //Handle the client's complete messages until it runs out of tokens.
+    //False if it did; the rest stays in the input ring. A client that
+    //switches to binary mode has its following input read as frames.
+    bool process_lines(Connection *conn, LineFramer &framer) {
+        bool within_limit = true;
+        auto handle = [this, conn, &within_limit](const struct iovec *parts, int count) {
+            return take_message(conn, parts, count, within_limit);
+        };
+        if (!conn->binary)
+            framer.extract([conn, &handle](const struct iovec *parts, int count) {
+                return !conn->binary && handle(parts, count);
+            });
+        if (conn->binary && within_limit && !framer.extract_frames(handle))
+            drop(conn, "bad frame");
+        return within_limit;
+    }
+
+    bool take_message(Connection *conn, const struct iovec *parts, int count, bool &within_limit) {
+        if (conn->link)
+            return true; //became a peer link, it sends frames after "peer ok"
+        size_t bytes = 0;
+        for (int i = 0; i < count; ++i)
+            bytes += parts[i].iov_len;
+        if (limiter_.enabled() && !restoring_ && !limiter_.take(conn, now_, bytes)) {
+            conn->resume_ms = now_ + limiter_.wait_ms(conn, bytes);
+            within_limit = false;
+            return false;
+        }
+        logparts(parts, count);
+        if (!handle_command(conn, parts, count)) {
+            broadcast(conn->room, parts, count);
+            forward(conn->room, parts, count);
+        }
+        return true;
+    }
+
+    //Over the limit: stop reading from the socket until the tokens are
+    //back. The client's own TCP window then pushes back on it.
+    void throttle(Connection *conn) {
+        conn->throttled = true;
+        ++throttled_;
+        loop_->pause_reads(conn);
+        arm_timer(conn);
+    }
+
+    void resume(Connection *conn) {
+        LineFramer &framer = clients_.input(conn);
+        bool within_limit = process_lines(conn, framer);
+        if (framer.empty())
+            clients_.release_input(conn);
+        if (conn->closing)
+            return;
+        if (within_limit) {
+            conn->throttled = false;
+            loop_->resume_reads(conn);
+        }
+        if (!conn->closing)
+            arm_timer(conn);
+    }
+
+    //Pass the listening socket and the clients to the new server on the
+    //control socket. Peer links are not passed on; both sides redial.
+    //Once the new server is connected there is no way back: the old one
+    //exits even if the transfer fails.
+    bool hand_off() {
+        if (control_socket_ == -1)
+            return false;
+        int Control = accept(control_socket_, 0, 0);
+        if (Control == -1)
+            return false;
+        int flags = fcntl(Control, F_GETFL, 0);
+        fcntl(Control, F_SETFL, flags & ~O_NONBLOCK);
+
+        uint64_t start = now_ms();
+        reap();
+        loop_->quiesce();
+        std::vector<HandoffClient> clients;
+        for (auto conn : clients_.active()) {
+            if (conn->link || conn->closing)
+                continue;
+            HandoffClient client;
+            client.fd = conn->fd;
+            client.binary = conn->binary;
+            client.room = rooms_.name(conn->room);
+            if (conn->input) {
+                struct iovec parts[2];
+                int count = conn->input->data(conn->input->size(), parts);
+                for (int i = 0; i < count; ++i)
+                    client.input.append(static_cast<const char *>(parts[i].iov_base), parts[i].iov_len);
+            }
+            client.input += loop_->take_unread(conn);
+            if (conn->output) {
+                struct iovec parts[2];
+                int count = conn->output->data(conn->output->size(), parts);
+                for (int i = 0; i < count; ++i)
+                    client.output.append(static_cast<const char *>(parts[i].iov_base), parts[i].iov_len);
+            }
+            clients.push_back(std::move(client));
+        }
+
+        if (!Handoff::send_listener(Control, master_socket_) || !Handoff::send_clients(Control, clients))
+            logstr("handoff failed: " + std::string(strerror(errno)));
+        else
+            logstr("handed off " + std::to_string(clients.size()) + " connections in "
+                   + std::to_string(now_ms() - start) + " ms");
+        ::close(Control);
+        return true;
+    }
+
+    static uint32_t random_origin() {
+        std::random_device Random;
+        uint32_t origin;
+        do
+            origin = Random();
+        while (origin == 0);
+        return origin;
+    }
+
+    //Chat commands: "/join <room>" and "/leave". Anything else is a message.
+    //"/peer <origin>" turns the connection into an inbound federation link,
+    //if it comes from one of the configured peers.
+    //"/binary" is answered with "binary ok\n"; after that both directions
+    //use varint-framed messages.
+    bool handle_command(Connection *conn, const struct iovec *parts, int count) {
+        if (count == 0 || static_cast<const char *>(parts[0].iov_base)[0] != '/')
+            return false;
+
+        std::string line;
+        for (int i = 0; i < count; ++i)
+            line.append(static_cast<const char *>(parts[i].iov_base), parts[i].iov_len);
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+
+        std::string reply;
+        if (line.compare(0, 6, "/join ") == 0) {
+            std::string name = line.substr(6);
+            if (name.empty() || name.size() > max_room_name || name.find(' ') != std::string::npos)
+                reply = "usage: /join <room>\n";
+            else {
+                rooms_.join(conn, rooms_.find_or_create(name));
+                reply = "joined " + name + "\n";
+            }
+        }
+        else if (line.compare(0, 6, "/peer ") == 0) {
+            if (!known_peer(conn, line.substr(6)))
+                reply = "usage: /peer <origin>\n";
             else {
-                static char Buffer[1024];
-                int RecvSize = recv(KEvent.ident, Buffer, 1024, MSG_HAVEMORE);
-                if(RecvSize <= 0) {
-                    close(KEvent.ident);
-                    messages[KEvent.ident] = "";
-                    logstr("connection terminated");
+                rooms_.leave(conn);
+                timers_.cancel(&conn->timer);
+                conn->link = inbound_link;
+                incoming_[conn->fd] = FrameDecoder();
+                logstr("peer link from " + line.substr(6));
+                reply = "peer ok\n";
+            }
+        }
+        else if (line == "/binary") {
+            send_line(conn, "binary ok\n");
+            conn->binary = true;
+            return true;
+        }
+        else if (line == "/leave") {
+            if (conn->room == RoomTable::lobby)
+                reply = "not in a room\n";
+            else {
+                reply = "left " + rooms_.name(conn->room) + "\n";
+                rooms_.join(conn, RoomTable::lobby);
+            }
+        }
+        else
+            return false;
+
+        send_line(conn, reply);
+        return true;
+    }
+
+    //A well-formed origin other than our own, from the address of a peer we
+    //were given with -P. Without peers there is no federation to join.
+    bool known_peer(Connection *conn, const std::string &origin) const {
+        if (origin.empty() || origin.size() > 10 || origin.find_first_not_of("0123456789") != std::string::npos)
+            return false;
+        unsigned long long id = strtoull(origin.c_str(), nullptr, 10);
+        if (id == 0 || id > UINT32_MAX || id == origin_)
+            return false;
+
+        struct sockaddr_in from;
+        socklen_t length = sizeof(from);
+        if (getpeername(conn->fd, reinterpret_cast<struct sockaddr *>(&from), &length) != 0
+            || from.sin_family != AF_INET)
+            return false;
+        for (const PeerAddress &peer : options_.peers) {
+            if (peer.addr.sin_addr.s_addr == from.sin_addr.s_addr)
+                return true;
+        }
+        return false;
+    }
+
+    //A server line ending in '\n', framed for binary clients.
+    void send_line(Connection *conn, const std::string &line) {
+        struct iovec iov[2];
+        unsigned char prefix[8];
+        if (conn->binary) {
+            iov[0].iov_base = prefix;
+            iov[0].iov_len = encode_varint(line.size() - 1, prefix);
+            iov[1].iov_base = const_cast<char *>(line.data());
+            iov[1].iov_len = line.size() - 1;
+        }
+        else {
+            iov[0].iov_base = const_cast<char *>(line.data());
+            iov[0].iov_len = line.size();
+            iov[1].iov_len = 0;
+        }
+        deliver(conn, iov, iov[1].iov_len ? 2 : 1);
+    }
+
+    //Send one message (given as ring slices) to the room: followed by '\n'
+    //to text clients, behind a length prefix to binary ones.
+    void broadcast(uint32_t room, const struct iovec *parts, int count) {
+        static char NewLine[] = "\n";
+        struct iovec text[3], binary[3];
+        unsigned char prefix[8];
+        size_t length = 0;
+        for (int i = 0; i < count; ++i) {
+            text[i] = parts[i];
+            binary[i + 1] = parts[i];
+            length += parts[i].iov_len;
+        }
+        text[count].iov_base = NewLine;
+        text[count].iov_len = 1;
+        binary[0].iov_base = prefix;
+        binary[0].iov_len = encode_varint(length, prefix);
+
+        for (auto client : rooms_.members(room)) {
+            struct iovec iov[3];
+            memcpy(iov, client->binary ? binary : text, sizeof(iov));
+            deliver(client, iov, count + 1);
+        }
+    }
+
+    void connect_peer(PeerLink &link) {
+        Connection *conn = loop_->connect(&link.address.addr);
+        if (!conn) {
+            timers_.schedule(&link.retry, now_ + options_.peer_retry_ms);
+            return;
+        }
+        conn->link = outbound_link;
+        link.conn = conn;
+        std::string hello = "/peer " + std::to_string(origin_) + "\n";
+        struct iovec iov = { &hello[0], hello.size() };
+        deliver(conn, &iov, 1);
+    }
+
+    //The peer greets with "Welcome" first; frames go out after "peer ok".
+    void on_peer_reply(Connection *conn, const struct iovec *parts, int count) {
+        static const char Ok[] = "peer ok";
+        if (count != 1 || parts[0].iov_len != sizeof(Ok) - 1 || memcmp(parts[0].iov_base, Ok, sizeof(Ok) - 1) != 0)
+            return;
+        for (auto &link : links_)
+            if (link.conn == conn && !link.ready) {
+                link.ready = true;
+                logstr("peer link to " + link.address.name + " up");
+            }
+    }
+
+    void receive_frames(Connection *conn, LineFramer &framer) {
+        bool valid = framer.empty() || incoming_[conn->fd].decode(framer,
+            [this](uint32_t origin, uint32_t seq, const std::string &room_name, struct iovec *parts, int count) {
+                uint32_t room;
+                if (!seen_.accept(origin, seq) || !rooms_.find(room_name, room))
+                    return;
+                ++received_;
+                broadcast(room, parts, count);
+            });
+        if (!valid)
+            drop(conn, "bad peer frame");
+    }
+
+    //Queue a local message for the peers; it goes out with the next frame.
+    void forward(uint32_t room, const struct iovec *parts, int count) {
+        if (links_.empty())
+            return;
+        if (outgoing_.full())
+            flush_links();
+        outgoing_.add(rooms_.name(room), parts, count);
+    }
+
+    //One frame per iteration, the same bytes to every peer.
+    void flush_links() {
+        if (outgoing_.empty())
+            return;
+        struct iovec frame[2];
+        outgoing_.frame(origin_, frame);
+        for (auto &link : links_) {
+            if (!link.ready || link.conn->closing)
+                continue;
+            struct iovec iov[2] = { frame[0], frame[1] };
+            if (!loop_->send(link.conn, iov, 2))
+                drop(link.conn, "peer link overflow");
+            else
+                ++frames_sent_;
+        }
+        outgoing_.clear();
+    }
+
+    //A message is either sent or queued whole, or the client is dropped.
+    //The backend may modify iov.
+    void deliver(Connection *conn, struct iovec *iov, int count) {
+        if (conn->closing)
+            return;
+        ++delivered_;
+        if (!loop_->send(conn, iov, count)) {
+            ++dropped_slow_;
+            drop(conn, "output buffer overflow");
+        }
+    }
+
+    //One timer per client, due at the earlier of its two deadlines. Reads
+    //and writes only update timestamps; the timer re-arms itself lazily.
+    void arm_timer(Connection *conn) {
+        uint64_t deadline = now_ + options_.idle_timeout_ms - uint32_t(now_ - conn->last_read_ms);
+        if (conn->output) {
+            uint64_t stall = now_ + options_.write_timeout_ms - uint32_t(now_ - conn->last_write_ms);
+            deadline = std::min(deadline, stall);
+        }
+        if (conn->throttled)
+            deadline = std::min(deadline, now_ + int32_t(conn->resume_ms - uint32_t(now_)));
+        timers_.schedule(&conn->timer, deadline);
+    }
+
+    void on_timer(TimerNode *node) {
+        if (node == &housekeeping_) {
+            clients_.trim();
+            timers_.schedule(&housekeeping_, now_ + options_.housekeeping_ms);
+            return;
+        }
+        for (auto &link : links_)
+            if (node == &link.retry) {
+                connect_peer(link);
+                return;
+            }
+        Connection *conn = reinterpret_cast<Connection *>(reinterpret_cast<char *>(node) - offsetof(Connection, timer));
+        if (conn->throttled && int32_t(uint32_t(now_) - conn->resume_ms) >= 0)
+            resume(conn);
+        else if (uint32_t(now_ - conn->last_read_ms) >= options_.idle_timeout_ms) {
+            ++dropped_idle_;
+            drop(conn, "idle timeout");
+        }
+        else if (conn->output && uint32_t(now_ - conn->last_write_ms) >= options_.write_timeout_ms) {
+            ++dropped_slow_;
+            drop(conn, "write timeout");
+        }
+        else
+            arm_timer(conn);
+    }
+
+    //Connections are closed after the current batch of events, so that the
+    //active list is not modified while a broadcast walks it and the fd is
+    //not reused by an accept within the same batch.
+    void drop(Connection *conn, const char *reason) {
+        if (conn->closing)
+            return;
+        conn->closing = true;
+        timers_.cancel(&conn->timer);
+        closing_.push_back(conn);
+        if (conn->link == outbound_link) {
+            for (auto &link : links_)
+                if (link.conn == conn) {
+                    link.conn = nullptr;
+                    link.ready = false;
+                    timers_.schedule(&link.retry, now_ + options_.peer_retry_ms);
+                    logstr("peer link to " + link.address.name + " down" + (reason ? std::string(": ") + reason : ""));
                 }
-                else {
-                    messages[KEvent.ident] += std::string(Buffer).substr(0, RecvSize);
-                    if (Buffer[RecvSize-1] == '\n') {
-                        auto message = messages[KEvent.ident];
-                        logstr(message.substr(0, message.length()-1));
-                        for(auto client : clients) {
-                            send(client, message.c_str(), message.length(), MSG_HAVEMORE);
-                        }
-                        messages[KEvent.ident] = "";
-                    }
+            return;
+        }
+        logstr(reason ? std::string("connection terminated: ") + reason : "connection terminated");
+    }
+
+    void reap() {
+        for (auto conn : closing_) {
+            if (conn->link == inbound_link)
+                incoming_.erase(conn->fd);
+            rooms_.leave(conn);
+            loop_->close(conn);
+        }
+        closing_.clear();
+    }
+
+    //kill -USR1 <pid> prints the table footprint to stderr.
+    void print_stats() {
+        std::cerr << "backend: " << loop_->name()
+                  << ", messages delivered: " << delivered_
+                  << ", syscalls: " << loop_->syscalls()
+                  << ", syscalls per message: " << (delivered_ ? double(loop_->syscalls()) / delivered_ : 0.0)
+                  << ", connections: " << clients_.size()
+                  << ", rejected (full): " << loop_->rejected()
+                  << ", bytes per connection slot: " << sizeof(Connection)
+                  << ", buffers in use: " << clients_.buffers_in_use()
+                  << ", table memory: " << clients_.memory_usage() << " bytes"
+                  << ", binary clients: " << std::count_if(clients_.active().begin(), clients_.active().end(),
+                                                           [](const Connection *conn) { return conn->binary; })
+                  << ", rooms: " << rooms_.size()
+                  << ", peer links up: " << std::count_if(links_.begin(), links_.end(),
+                                                           [](const PeerLink &link) { return link.ready; })
+                  << " of " << links_.size()
+                  << ", peer frames sent: " << frames_sent_
+                  << ", peer messages received: " << received_
+                  << ", timers: " << timers_.size()
+                  << ", dropped idle: " << dropped_idle_
+                  << ", dropped slow: " << dropped_slow_
+                  << ", throttled: " << throttled_
+                  << " (now " << std::count_if(clients_.active().begin(), clients_.active().end(),
+                                               [](const Connection *conn) { return conn->throttled; }) << ")"
+                  << ", log lines dropped: " << server_log().dropped() << std::endl;
+    }
+
+    Options options_;
+    int master_socket_, control_socket_;
+    uint64_t now_;
+    ConnectionTable clients_;
+    std::unique_ptr<EventLoop> loop_;
+    TimerWheel timers_;
+    RateLimiter limiter_;
+    RoomTable rooms_;
+    TimerNode housekeeping_;
+    std::vector<Connection *> closing_;
+    uint32_t origin_;
+    FrameEncoder outgoing_;
+    OriginFilter seen_;
+    std::vector<PeerLink> links_;
+    std::unordered_map<int, FrameDecoder> incoming_;
+    uint64_t delivered_;
+    size_t dropped_slow_, dropped_idle_;
+    uint64_t throttled_;
+    uint64_t frames_sent_, received_;
+    bool restoring_;    //replaying input handed over by the old server
+};
+
+void usage(const char *name) {
+    std::cerr << "Usage: " << name << " [-i idle_timeout_s] [-w write_timeout_s] [-r msgs_per_s] [-b bytes_per_s] [-a accept_batch] [-c max_connections] [-u] [-p port] [-P peer_host:port]... [-H control_socket]" << std::endl;
+}
+
+//Hot restart: if a server listens on `path`, wake it and take its sockets.
+//False if there is none; master_socket stays -1 if the transfer failed.
+bool take_over(const std::string &path, int &master_socket, std::vector<HandoffClient> &clients) {
+    struct sockaddr_un Addr;
+    if (!Handoff::set_path(path, Addr))
+        return false;
+    int Control = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Control == -1)
+        return false;
+    if (connect(Control, (struct sockaddr *)&Addr, sizeof(Addr)) == -1) {
+        close(Control);
+        return false;
+    }
+
+    pid_t Pid = 0;
+#if defined(__linux__)
+    struct ucred Cred;
+    socklen_t Size = sizeof(Cred);
+    if (getsockopt(Control, SOL_SOCKET, SO_PEERCRED, &Cred, &Size) == 0)
+        Pid = Cred.pid;
+#else
+    socklen_t Size = sizeof(Pid);
+    getsockopt(Control, SOL_LOCAL, LOCAL_PEERPID, &Pid, &Size);
+#endif
+    if (Pid <= 0 || kill(Pid, SIGUSR2) == -1) {
+        close(Control);
+        return true;
+    }
+
+    master_socket = Handoff::receive_listener(Control);
+    if (master_socket != -1 && !Handoff::receive_clients(Control, clients)) {
+        close(master_socket);
+        master_socket = -1;
+    }
+    close(Control);
+    return true;
+}
+
+//Listen on `path` for the next server, replacing what is there.
+int open_control(const std::string &path) {
+    struct sockaddr_un Addr;
+    if (!Handoff::set_path(path, Addr))
+        return -1;
+    int Control = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (Control == -1)
+        return -1;
+    unlink(path.c_str());
+    if (bind(Control, (struct sockaddr *)&Addr, sizeof(Addr)) == -1 || listen(Control, 4) == -1) {
+        close(Control);
+        return -1;
+    }
+    set_nonblock(Control);
+    return Control;
+}
+
+int main(int argc, char **argv) {
+    Options options;
+    int Option;
+    while ((Option = getopt(argc, argv, "i:w:r:b:a:c:up:P:H:")) != -1) {
+        switch (Option) {
+            case 'i': options.idle_timeout_ms = atoi(optarg) * 1000; break;
+            case 'w': options.write_timeout_ms = atoi(optarg) * 1000; break;
+            case 'r': options.msgs_per_s = atoi(optarg); break;
+            case 'b': options.bytes_per_s = atoi(optarg); break;
+            case 'a': options.accept_batch = std::max(1, atoi(optarg)); break;
+            case 'c': options.max_connections = atoi(optarg); break;
+            case 'u': options.io_uring = true; break;
+            case 'p': options.port = atoi(optarg); break;
+            case 'P': {
+                PeerAddress peer;
+                if (!parse_peer(optarg, peer)) {
+                    std::cerr << "bad peer address: " << optarg << std::endl;
+                    return 1;
                 }
+                options.peers.push_back(peer);
+                break;
             }
+            case 'H': options.handoff_path = optarg; break;
+            default: usage(argv[0]); return 1;
         }
     }
+
+    //A client per fd, plus the old server's during a hot restart.
+    struct rlimit Limit;
+    if (getrlimit(RLIMIT_NOFILE, &Limit) == 0 && Limit.rlim_cur < Limit.rlim_max) {
+        Limit.rlim_cur = Limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &Limit);
+    }
+
+    //No SA_RESTART: the wait must return so that the stats get printed.
+    //SIGUSR2 must be handled before the control socket is there.
+    struct sigaction Action;
+    bzero(&Action, sizeof(Action));
+    Action.sa_handler = request_stats;
+    sigaction(SIGUSR1, &Action, nullptr);
+    Action.sa_handler = request_handoff;
+    sigaction(SIGUSR2, &Action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    int MasterSocket = -1;
+    std::vector<HandoffClient> Inherited;
+    uint64_t Start = now_ms();
+    bool TakingOver = !options.handoff_path.empty() && take_over(options.handoff_path, MasterSocket, Inherited);
+    if (TakingOver && MasterSocket == -1) {
+        std::cout << "handoff failed" << std::endl;
+        return 1;
+    }
+
+    if (MasterSocket == -1) {
+        MasterSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+        if(MasterSocket == -1) {
+            std::cout << strerror(errno) << std::endl;
+            return 1;
+        }
+
+        int enable = 1;
+        if (setsockopt(MasterSocket, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(int)) < 0)
+            std::cout << "setsockopt(SO_REUSEADDR) failed" << std::endl;
+
+        struct sockaddr_in SockAddr;
+        SockAddr.sin_family = AF_INET;
+        SockAddr.sin_port = htons(options.port);
+        SockAddr.sin_addr.s_addr = INADDR_ANY;
+
+        //An io_uring instance of a previous server is torn down asynchronously
+        //after it exits and keeps the port for a moment; wait for it.
+        int Result;
+        for (int Attempt = 0; Attempt < 50; ++Attempt) {
+            Result = bind(MasterSocket, (struct sockaddr *)&SockAddr, sizeof(SockAddr));
+            if (Result == 0 || errno != EADDRINUSE)
+                break;
+            usleep(20 * 1000);
+        }
+
+        if(Result == -1) {
+            std::cout << strerror(errno) << std::endl;
+            return 1;
+        }
+
+        Result = listen(MasterSocket, SOMAXCONN);
+
+        if(Result == -1) {
+            std::cout << strerror(errno) << std::endl;
+            return 1;
+        }
+    }
+
+    set_nonblock(MasterSocket);
+
+    int Control = -1;
+    if (!options.handoff_path.empty() && (Control = open_control(options.handoff_path)) == -1) {
+        std::cout << "cannot listen on " << options.handoff_path << std::endl;
+        return 1;
+    }
+
+    try {
+        ChatServer server(MasterSocket, Control, options);
+        if (TakingOver) {
+            server.restore(Inherited);
+            logstr("took over " + std::to_string(Inherited.size()) + " connections in "
+                   + std::to_string(now_ms() - Start) + " ms");
+        }
+        server.run();
+    }
+    catch (std::exception &e) {
+        std::cout << e.what() << std::endl;
+        return 1;
+    }
     
     return 0;
 }
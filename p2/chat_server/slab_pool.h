@@ -0,0 +1,86 @@
+#ifndef CHATSRV_SLAB_POOL_H
+#define CHATSRV_SLAB_POOL_H
+
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <new>
+#include <vector>
+
+//Fixed-size object pool: objects are carved out of slabs of `per_slab`
+//elements and recycled through an intrusive free list. Live objects never
+//move; only completely free slabs are given back, and only by trim().
+template <class T, size_t per_slab = 64>
+class SlabPool {
+public:
+    SlabPool() : free_(nullptr), in_use_(0) {}
+    SlabPool(const SlabPool &) = delete;
+    SlabPool &operator=(const SlabPool &) = delete;
+
+    T *acquire() {
+        if (!free_)
+            grow();
+        Node *node = free_;
+        free_ = node->next;
+        ++in_use_;
+        return new (node->storage) T();
+    }
+
+    void release(T *object) {
+        object->~T();
+        Node *node = reinterpret_cast<Node *>(object);
+        node->next = free_;
+        free_ = node;
+        --in_use_;
+    }
+
+    //Return slabs with no live objects to the system. Walks the whole free
+    //list, so it is meant for periodic housekeeping, not the hot path.
+    void trim() {
+        std::vector<Node *> free_nodes;
+        for (Node *node = free_; node; node = node->next)
+            free_nodes.push_back(node);
+        std::sort(free_nodes.begin(), free_nodes.end(), std::less<Node *>());
+
+        std::vector<std::unique_ptr<Node[]>> kept;
+        free_ = nullptr;
+        for (auto &slab : slabs_) {
+            Node *begin = slab.get();
+            auto first = std::lower_bound(free_nodes.begin(), free_nodes.end(), begin, std::less<Node *>());
+            auto last = std::lower_bound(first, free_nodes.end(), begin + per_slab, std::less<Node *>());
+            if (static_cast<size_t>(last - first) == per_slab)
+                continue;
+            for (auto it = first; it != last; ++it) {
+                (*it)->next = free_;
+                free_ = *it;
+            }
+            kept.push_back(std::move(slab));
+        }
+        slabs_.swap(kept);
+    }
+
+    size_t in_use() const { return in_use_; }
+    size_t capacity() const { return slabs_.size() * per_slab; }
+    size_t memory_usage() const { return slabs_.size() * per_slab * sizeof(Node); }
+
+private:
+    union Node {
+        Node *next;
+        alignas(T) unsigned char storage[sizeof(T)];
+    };
+
+    void grow() {
+        slabs_.emplace_back(new Node[per_slab]);
+        Node *slab = slabs_.back().get();
+        for (size_t i = 0; i < per_slab; ++i) {
+            slab[i].next = free_;
+            free_ = &slab[i];
+        }
+    }
+
+    std::vector<std::unique_ptr<Node[]>> slabs_;
+    Node *free_;
+    size_t in_use_;
+};
+
+#endif //CHATSRV_SLAB_POOL_H
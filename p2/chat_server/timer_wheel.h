@@ -0,0 +1,128 @@
+#ifndef CHATSRV_TIMER_WHEEL_H
+#define CHATSRV_TIMER_WHEEL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Intrusive timer: embed it in the object that owns the timeout.
+struct TimerNode {
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expires = 0;  //in ticks
+
+    bool scheduled() const { return prev != nullptr; }
+};
+
+//Hierarchical timing wheel (Varghese & Lauck). Four levels of 64 slots:
+//with a 100 ms tick that covers 6.4 s / 6.8 min / 7.3 h / 19.4 days.
+//Schedule and cancel are O(1); a timer is moved down at most once per
+//level as its deadline approaches.
+class TimerWheel {
+public:
+    enum { slot_bits = 6, slots = 1 << slot_bits, levels = 4 };
+
+    TimerWheel(uint64_t now_ms, unsigned tick_ms) : tick_ms_(tick_ms), current_(now_ms / tick_ms), count_(0) {
+        for (int level = 0; level < levels; ++level)
+            for (int slot = 0; slot < slots; ++slot) {
+                TimerNode &head = wheel_[level][slot];
+                head.prev = head.next = &head;
+            }
+    }
+    TimerWheel(const TimerWheel &) = delete;
+    TimerWheel &operator=(const TimerWheel &) = delete;
+
+    void schedule(TimerNode *node, uint64_t when_ms) {
+        if (node->scheduled())
+            cancel(node);
+        uint64_t ticks = (when_ms + tick_ms_ - 1) / tick_ms_;
+        node->expires = ticks > current_ ? ticks : current_ + 1;
+        insert(node);
+        ++count_;
+    }
+
+    void cancel(TimerNode *node) {
+        if (!node->scheduled())
+            return;
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = node->next = nullptr;
+        --count_;
+    }
+
+    size_t size() const { return count_; }
+
+    //Run every timer that is due at now_ms. on_expire(node) may schedule or
+    //cancel any timer, including the one it was called for.
+    template <class Handler>
+    void advance(uint64_t now_ms, Handler on_expire) {
+        uint64_t target = now_ms / tick_ms_;
+        while (current_ < target) {
+            ++current_;
+            if (count_ == 0) {
+                current_ = target;
+                break;
+            }
+            cascade();
+            TimerNode &head = wheel_[0][current_ & (slots - 1)];
+            while (head.next != &head) {
+                TimerNode *node = head.next;
+                cancel(node);
+                on_expire(node);
+            }
+        }
+    }
+
+    //Milliseconds until the next tick that has work, -1 when idle. Level 0
+    //wrapping around may cascade timers down, so never sleep past it.
+    int next_timeout_ms(uint64_t now_ms) const {
+        if (count_ == 0)
+            return -1;
+        uint64_t ticks = slots - (current_ & (slots - 1));
+        for (uint64_t i = 1; i < ticks; ++i) {
+            const TimerNode &head = wheel_[0][(current_ + i) & (slots - 1)];
+            if (head.next != &head) {
+                ticks = i;
+                break;
+            }
+        }
+        uint64_t wake = (current_ + ticks) * tick_ms_;
+        return wake > now_ms ? static_cast<int>(wake - now_ms) : 0;
+    }
+
+private:
+    void insert(TimerNode *node) {
+        uint64_t delta = node->expires - current_;
+        int level = 0;
+        while (level < levels - 1 && delta >= (uint64_t(1) << (slot_bits * (level + 1))))
+            ++level;
+        if (level == levels - 1 && delta >= (uint64_t(1) << (slot_bits * levels)))
+            node->expires = current_ + (uint64_t(1) << (slot_bits * levels)) - 1;
+        TimerNode &head = wheel_[level][(node->expires >> (slot_bits * level)) & (slots - 1)];
+        node->next = &head;
+        node->prev = head.prev;
+        head.prev->next = node;
+        head.prev = node;
+    }
+
+    //When a lower level wraps, redistribute the next slot of the level above.
+    void cascade() {
+        for (int level = 1; level < levels; ++level) {
+            if ((current_ >> (slot_bits * (level - 1))) & (slots - 1))
+                break;
+            TimerNode &head = wheel_[level][(current_ >> (slot_bits * level)) & (slots - 1)];
+            while (head.next != &head) {
+                TimerNode *node = head.next;
+                node->prev->next = node->next;
+                node->next->prev = node->prev;
+                insert(node);
+            }
+        }
+    }
+
+    uint64_t tick_ms_;
+    uint64_t current_;
+    size_t count_;
+    TimerNode wheel_[levels][slots];
+};
+
+#endif //CHATSRV_TIMER_WHEEL_H
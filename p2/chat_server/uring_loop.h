@@ -0,0 +1,566 @@
+#ifndef CHATSRV_URING_LOOP_H
+#define CHATSRV_URING_LOOP_H
+
+//io_uring backend, Linux 6.0 or newer. Talks to the kernel through the raw
+//syscalls, so it needs the kernel headers but not liburing.
+
+#if defined(__linux__)
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <system_error>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+
+#include "event_loop.h"
+
+//Completion-based backend. A multishot accept and one multishot recv per
+//client stay armed in the kernel; received data lands in a pool of buffers
+//handed to the kernel up front and given back in batches. Sends are queued
+//per client during an iteration and submitted together by flush(), a
+//wrapped output ring as two linked SENDs, so every loop iteration costs a
+//single io_uring_enter.
+class UringLoop : public EventLoop {
+public:
+    enum {
+        queue_depth = 4096,
+        buffer_count = 1024,    //provided recv buffers
+        buffer_size = 4096,
+        buffer_group = 0,
+        quiesce_ms = 2000       //hot restart: wait for sends in flight
+    };
+
+    UringLoop(ConnectionTable &clients, EventHandler &handler, int master_socket)
+    : EventLoop(clients, handler), master_socket_(master_socket), ring_fd_(-1), sq_tail_(0), submitted_(0),
+      accept_armed_(false), quiescing_(false), buffers_(size_t(buffer_count) * buffer_size) {
+        setup();
+        //Multishot requests park on the socket themselves; with O_NONBLOCK
+        //they would complete with -EAGAIN instead.
+        set_blocking(master_socket_);
+        arm_accept();
+    }
+
+    ~UringLoop() {
+        if (sqes_ != MAP_FAILED)
+            munmap(sqes_, sqes_size_);
+        if (rings_ != MAP_FAILED)
+            munmap(rings_, rings_size_);
+        if (ring_fd_ != -1)
+            ::close(ring_fd_);
+    }
+
+    const char *name() const { return "io_uring"; }
+
+    Connection *connect(const struct sockaddr_in *addr) {
+        int Socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
+        ++syscalls_;
+        if (Socket == -1)
+            return nullptr;
+        Connection *conn = clients_.add(Socket);
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_CONNECT;
+        sqe->fd = Socket;
+        sqe->addr = reinterpret_cast<uint64_t>(addr);
+        sqe->off = sizeof(*addr);
+        sqe->user_data = tag(op_connect, Socket);
+        conn->io_flags |= connecting;
+        return conn;
+    }
+
+    Connection *adopt(int fd) {
+        set_blocking(fd);
+        syscalls_ += 2;
+        Connection *conn = clients_.add(fd);
+        arm_recv(conn);
+        return conn;
+    }
+
+    bool send(Connection *conn, struct iovec *iov, int count) {
+        bool idle = !conn->output;
+        if (!clients_.output(conn).append(iov, count))
+            return false;
+        if (idle)
+            handler_.on_output(conn);
+        if (!(conn->io_flags & send_queued) && conn->io_sends == 0) {
+            conn->io_flags |= send_queued;
+            pending_sends_.push_back(conn);
+        }
+        return true;
+    }
+
+    //The multishot recv is cancelled. Whatever it still delivers, and what
+    //does not fit into the line framer, is copied out of the recv buffer
+    //and held per client, so a paused client never keeps buffers of the
+    //shared pool.
+    void pause_reads(Connection *conn) {
+        conn->io_flags |= read_paused;
+        if (conn->io_flags & recv_armed) {
+            io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = tag(op_recv, conn->fd);
+            sqe->user_data = tag(op_cancel, conn->fd);
+        }
+    }
+
+    void resume_reads(Connection *conn) {
+        conn->io_flags &= ~read_paused;
+        if (!drain_held(conn) || conn->closing)
+            return;
+        if (conn->io_flags & hangup_held)
+            handler_.on_hangup(conn);
+        else if (!(conn->io_flags & recv_armed))
+            arm_recv(conn);
+    }
+
+    void close(Connection *conn) {
+        conn->io_flags |= closing;
+        if (conn->io_flags & (recv_armed | connecting) || conn->io_sends) {
+            io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->fd = conn->fd;
+            sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+            sqe->user_data = tag(op_cancel, conn->fd);
+        }
+        else
+            release(conn);
+    }
+
+    void flush() {
+        provide_returned();
+        for (auto conn : pending_sends_) {
+            conn->io_flags &= ~send_queued;
+            if (!(conn->io_flags & (closing | connecting)))
+                submit_send(conn);
+        }
+        pending_sends_.clear();
+        for (auto conn : pending_recvs_)
+            if (!(conn->io_flags & closing))
+                arm_recv(conn);
+        pending_recvs_.clear();
+        if (!accept_armed_ && !quiescing_)
+            arm_accept();
+    }
+
+    //Cancel the accept and all recvs, then let the sends in flight finish.
+    //A client that does not take its output within quiesce_ms has the send
+    //cancelled too; the kernel reports what went out and the rest stays in
+    //the ring.
+    void quiesce() {
+        quiescing_ = true;
+        if (accept_armed_) {
+            io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            sqe->addr = tag(op_accept, master_socket_);
+            sqe->user_data = tag(op_cancel, master_socket_);
+        }
+        for (auto conn : clients_.active())
+            if (!(conn->io_flags & read_paused))
+                pause_reads(conn);
+        pending_recvs_.clear();
+
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        time_t deadline = ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + quiesce_ms;
+        bool sends_cancelled = false;
+        while (true) {
+            flush();
+            bool busy = accept_armed_;
+            for (auto conn : clients_.active())
+                busy = busy || conn->io_flags & recv_armed || conn->io_sends;
+            if (!busy)
+                break;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            if (!sends_cancelled && ts.tv_sec * 1000 + ts.tv_nsec / 1000000 >= deadline) {
+                sends_cancelled = true;
+                for (auto conn : clients_.active())
+                    if (conn->io_sends) {
+                        io_uring_sqe *sqe = get_sqe();
+                        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                        sqe->fd = conn->fd;
+                        sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+                        sqe->user_data = tag(op_cancel, conn->fd);
+                    }
+            }
+            poll(10);
+        }
+    }
+
+    std::string take_unread(Connection *conn) {
+        std::string unread;
+        auto found = held_.find(conn->fd);
+        if (found == held_.end())
+            return unread;
+        unread.swap(found->second);
+        held_.erase(found);
+        return unread;
+    }
+
+    void poll(int timeout_ms) {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        struct io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = timeout_ms < 0 ? 0 : reinterpret_cast<uint64_t>(&ts);
+
+        unsigned wait = cq_ready() ? 0 : 1;
+        enter(wait, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+        reap();
+    }
+
+private:
+    enum : uint64_t { op_accept = 1, op_recv = 2, op_send = 3, op_cancel = 4, op_provide = 5, op_connect = 6 };
+    enum : uint8_t { recv_armed = 1, send_queued = 2, closing = 4, connecting = 8, read_paused = 16, hangup_held = 32 };
+
+    static uint64_t tag(uint64_t op, int fd) { return uint64_t(fd) << 8 | op; }
+
+    void setup() {
+        struct io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+        params.cq_entries = queue_depth * 4;
+        ring_fd_ = syscall(__NR_io_uring_setup, queue_depth, &params);
+        if (ring_fd_ < 0)
+            throw std::system_error(errno, std::system_category(), "io_uring_setup");
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+            throw std::system_error(ENOSYS, std::system_category(), "io_uring too old");
+
+        rings_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                               params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        rings_ = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd_, IORING_OFF_SQ_RING);
+        sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+        sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring_fd_, IORING_OFF_SQES);
+        if (rings_ == MAP_FAILED || sqes_ == MAP_FAILED)
+            throw std::system_error(errno, std::system_category(), "io_uring mmap");
+
+        char *base = static_cast<char *>(rings_);
+        sq_head_ = reinterpret_cast<unsigned *>(base + params.sq_off.head);
+        sq_tail_ptr_ = reinterpret_cast<unsigned *>(base + params.sq_off.tail);
+        sq_mask_ = *reinterpret_cast<unsigned *>(base + params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+        unsigned *array = reinterpret_cast<unsigned *>(base + params.sq_off.array);
+        for (unsigned i = 0; i < sq_entries_; ++i)
+            array[i] = i;
+        cq_head_ = reinterpret_cast<unsigned *>(base + params.cq_off.head);
+        cq_tail_ = reinterpret_cast<unsigned *>(base + params.cq_off.tail);
+        cq_mask_ = *reinterpret_cast<unsigned *>(base + params.cq_off.ring_mask);
+        cqes_ = reinterpret_cast<io_uring_cqe *>(base + params.cq_off.cqes);
+
+        //Provided buffers through an SQE rather than a registered buffer
+        //ring (IORING_REGISTER_PBUF_RING): buffers come back once per
+        //iteration anyway, and provide_returned() merges them into one SQE
+        //per run of consecutive ids, so a shared ring to manage would not
+        //save a syscall.
+        provide(0, buffer_count);
+    }
+
+    static void set_blocking(int fd) {
+        int flags = fcntl(fd, F_GETFL, 0);
+        if (flags != -1)
+            fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+
+    io_uring_sqe *get_sqe() {
+        if (sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) == sq_entries_)
+            enter(0, 0, nullptr, 0);
+        io_uring_sqe *sqe = &static_cast<io_uring_sqe *>(sqes_)[sq_tail_ & sq_mask_];
+        memset(sqe, 0, sizeof(*sqe));
+        ++sq_tail_;
+        return sqe;
+    }
+
+    void enter(unsigned min_complete, unsigned flags, void *arg, size_t arg_size) {
+        __atomic_store_n(sq_tail_ptr_, sq_tail_, __ATOMIC_RELEASE);
+        unsigned to_submit = sq_tail_ - submitted_;
+        int result = syscall(__NR_io_uring_enter, ring_fd_, to_submit, min_complete, flags, arg, arg_size);
+        ++syscalls_;
+        if (result > 0)
+            submitted_ += result;
+    }
+
+    bool cq_ready() const {
+        return *cq_head_ != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    }
+
+    void reap() {
+        unsigned head = *cq_head_;
+        while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            io_uring_cqe cqe = cqes_[head & cq_mask_];
+            ++head;
+            __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+            complete(cqe);
+        }
+    }
+
+    void complete(const io_uring_cqe &cqe) {
+        int fd = cqe.user_data >> 8;
+        switch (cqe.user_data & 0xff) {
+            case op_accept: {
+                //Drains the backlog in the kernel, one CQE per connection;
+                //the accept batch limit does not apply.
+                if (!(cqe.flags & IORING_CQE_F_MORE))
+                    accept_armed_ = false;
+                if (cqe.res >= 0 && !admit()) {
+                    ::close(cqe.res);
+                    ++syscalls_;
+                    ++rejected_;
+                }
+                else if (cqe.res >= 0) {
+                    Connection *conn = clients_.add(cqe.res);
+                    handler_.on_accept(conn);
+                    if (!conn->closing)
+                        arm_recv(conn);
+                }
+                break;
+            }
+            case op_recv:
+                if (Connection *conn = clients_.find(fd))
+                    complete_recv(conn, cqe);
+                else if (cqe.flags & IORING_CQE_F_BUFFER)
+                    returned_.push_back(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+                break;
+            case op_send:
+                if (Connection *conn = clients_.find(fd))
+                    complete_send(conn, cqe.res);
+                break;
+            case op_connect:
+                if (Connection *conn = clients_.find(fd))
+                    complete_connect(conn, cqe.res);
+                break;
+            default:
+                break;
+        }
+    }
+
+    void complete_recv(Connection *conn, const io_uring_cqe &cqe) {
+        bool more = cqe.flags & IORING_CQE_F_MORE;
+        if (!more)
+            conn->io_flags &= ~recv_armed;
+
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            unsigned bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe.res > 0 && !conn->closing)
+                receive(conn, bid, cqe.res);
+            else
+                returned_.push_back(bid);
+        }
+
+        if (conn->io_flags & closing) {
+            maybe_release(conn);
+            return;
+        }
+        if (conn->closing)
+            return;
+        if (cqe.res == 0 && held_.count(conn->fd))
+            conn->io_flags |= hangup_held;  //after the held data
+        else if (cqe.res == 0 || (cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED))
+            handler_.on_hangup(conn);
+        else if (!more && !(conn->io_flags & read_paused))
+            pending_recvs_.push_back(conn);  //out of buffers, try again later
+    }
+
+    //The buffer goes back to the kernel right away; what the client cannot
+    //take now is copied behind its held data.
+    void receive(Connection *conn, unsigned bid, uint32_t length) {
+        const char *data = &buffers_[size_t(bid) * buffer_size];
+        auto found = held_.find(conn->fd);
+        if (found != held_.end()) {
+            found->second.append(data, length);
+            drain_held(conn);
+        }
+        else {
+            size_t used = deliver_input(conn, data, length);
+            if (used < length && !conn->closing)
+                held_[conn->fd].assign(data + used, length - used);
+        }
+        returned_.push_back(bid);
+    }
+
+    //Feed held data to the framer. True once all of it is taken.
+    bool drain_held(Connection *conn) {
+        auto found = held_.find(conn->fd);
+        if (found == held_.end())
+            return true;
+        std::string &held = found->second;
+        held.erase(0, deliver_input(conn, held.data(), held.size()));
+        if (!held.empty())
+            return false;
+        held_.erase(found);
+        return true;
+    }
+
+    //Copy into the line framer in pieces it can always take: the framer
+    //keeps at most one partial message, so half its ring is free unless
+    //the client got paused. Returns the bytes taken.
+    size_t deliver_input(Connection *conn, const char *data, size_t size) {
+        size_t used = 0;
+        while (used < size && !conn->closing && !(conn->io_flags & read_paused)) {
+            LineFramer &framer = clients_.input(conn);
+            size_t chunk = std::min(size - used, framer.room());
+            if (chunk == 0)
+                break;
+            framer.append(data + used, chunk);
+            used += chunk;
+            handler_.on_input(conn);
+        }
+        return used;
+    }
+
+    void complete_connect(Connection *conn, int result) {
+        conn->io_flags &= ~connecting;
+        if (conn->io_flags & closing) {
+            maybe_release(conn);
+            return;
+        }
+        if (conn->closing)
+            return;
+        if (result < 0) {
+            handler_.on_hangup(conn);
+            return;
+        }
+        arm_recv(conn);
+        if (conn->output && !(conn->io_flags & send_queued)) {
+            conn->io_flags |= send_queued;
+            pending_sends_.push_back(conn);
+        }
+    }
+
+    void complete_send(Connection *conn, int result) {
+        --conn->io_sends;
+        if (result > 0 && conn->output) {
+            clients_.output(conn).consume(result);
+            if (!conn->closing)
+                handler_.on_output(conn);
+        }
+        if (conn->io_flags & closing) {
+            maybe_release(conn);
+            return;
+        }
+        if (conn->closing || conn->io_sends)
+            return;
+        if (result < 0 && result != -ECANCELED) {
+            handler_.on_hangup(conn);
+            return;
+        }
+        if (clients_.output(conn).empty())
+            clients_.release_output(conn);
+        else if (!(conn->io_flags & send_queued)) {
+            conn->io_flags |= send_queued;
+            pending_sends_.push_back(conn);
+        }
+    }
+
+    void arm_accept() {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = master_socket_;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe->accept_flags = SOCK_CLOEXEC;
+        sqe->user_data = tag(op_accept, master_socket_);
+        accept_armed_ = true;
+    }
+
+    void arm_recv(Connection *conn) {
+        if (quiescing_)
+            return;
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = conn->fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = buffer_group;
+        sqe->user_data = tag(op_recv, conn->fd);
+        conn->io_flags |= recv_armed;
+    }
+
+    //One SEND per contiguous piece of the output ring, linked so that the
+    //second starts only after the first completed in full.
+    void submit_send(Connection *conn) {
+        if (!conn->output || conn->output->empty())
+            return;
+        struct iovec parts[2];
+        int count = conn->output->data(conn->output->size(), parts);
+        for (int i = 0; i < count; ++i) {
+            io_uring_sqe *sqe = get_sqe();
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = conn->fd;
+            sqe->addr = reinterpret_cast<uint64_t>(parts[i].iov_base);
+            sqe->len = parts[i].iov_len;
+            sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+            sqe->user_data = tag(op_send, conn->fd);
+            if (i + 1 < count)
+                sqe->flags = IOSQE_IO_LINK;
+            ++conn->io_sends;
+        }
+    }
+
+    void maybe_release(Connection *conn) {
+        if (!(conn->io_flags & (recv_armed | connecting)) && conn->io_sends == 0)
+            release(conn);
+    }
+
+    void release(Connection *conn) {
+        held_.erase(conn->fd);
+        ::close(conn->fd);
+        ++syscalls_;
+        clients_.remove(conn);
+    }
+
+    void provide(unsigned first, unsigned count) {
+        io_uring_sqe *sqe = get_sqe();
+        sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+        sqe->fd = count;
+        sqe->addr = reinterpret_cast<uint64_t>(&buffers_[size_t(first) * buffer_size]);
+        sqe->len = buffer_size;
+        sqe->off = first;
+        sqe->buf_group = buffer_group;
+        sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+        sqe->user_data = tag(op_provide, 0);
+    }
+
+    //Hand consumed buffers back, merging runs of consecutive ids.
+    void provide_returned() {
+        std::sort(returned_.begin(), returned_.end());
+        for (size_t i = 0; i < returned_.size();) {
+            size_t j = i + 1;
+            while (j < returned_.size() && returned_[j] == returned_[j - 1] + 1)
+                ++j;
+            provide(returned_[i], j - i);
+            i = j;
+        }
+        returned_.clear();
+    }
+
+    int master_socket_;
+    int ring_fd_;
+    void *rings_ = MAP_FAILED, *sqes_ = MAP_FAILED;
+    size_t rings_size_ = 0, sqes_size_ = 0;
+    unsigned *sq_head_, *sq_tail_ptr_, *cq_head_, *cq_tail_;
+    unsigned sq_mask_, sq_entries_, cq_mask_;
+    io_uring_cqe *cqes_;
+    unsigned sq_tail_, submitted_;
+    bool accept_armed_, quiescing_;
+    std::vector<char> buffers_;
+    std::vector<Connection *> pending_sends_, pending_recvs_;
+    std::vector<unsigned> returned_;  //buffer ids to give back to the kernel
+    std::unordered_map<int, std::string> held_;  //input paused clients have not taken
+};
+
+#endif
+
+#endif //CHATSRV_URING_LOOP_H
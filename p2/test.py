@@ -1,5 +1,6 @@
 import subprocess
 import socket
+import struct
 import sys
 import threading
 import time
@@ -58,15 +59,18 @@ class PipeReader(object):
         sys.stderr.write("<exiting reader>\n")
 
 class TestBase(unittest.TestCase):
+    Args = []
+
     def setUp(self):
         sys.stderr.write("Staring server.\n")
-        self.server = subprocess.Popen(Cmdline, stdout=subprocess.PIPE)
+        self.server = subprocess.Popen(Cmdline + self.Args, stdout=subprocess.PIPE)
         self.reader = PipeReader(self.server.stdout)
         time.sleep(0.1)
 
     def tearDown(self):
         sys.stderr.write("Stopping server.\n")
-        self.server.kill()
+        if self.server.poll() is None:
+            self.server.kill()
         self.reader.join()
 
     def newClient(self):
@@ -215,6 +219,19 @@ class Test5(TestBase):
 
         c1.close()
 
+    def test_echoLong(self):
+        c1 = self.newClient()
+        c1f = c1.makefile()
+        c1f.readline()
+
+        c1.sendall("a" * 1500 + "\n" + "b" * 2048 + "\n")
+
+        for msg in ["a" * 1024 + "\n", "a" * 476 + "\n", "b" * 1024 + "\n", "b" * 1024 + "\n"]:
+            l = c1f.readline()
+            self.assertTrue(l.endswith(msg), "Received message of {0} bytes, expecting {1}".format(len(l), len(msg)))
+
+        c1.close()
+
 class Test6(TestBase):
     def test_communicate(self):
         c1 = self.newClient()
@@ -244,6 +261,337 @@ class Test6(TestBase):
         c1.close()
         c2.close()
 
+class Test7(TestBase):
+    Args = ["-i", "1"]
+
+    def test_idleTimeout(self):
+        c1 = self.newClient()
+        c2 = self.newClient()
+
+        for i in range(3):
+            time.sleep(0.4)
+            c2.sendall("ping\n")
+
+        self.assertTrue(waitFor(lambda: self.reader.countString("connection terminated") == 1, timeout=1.5),
+            "Idle client was not disconnected.")
+        self.assertTrue(c1.recv(1024).startswith("Welcome"))
+        self.assertTrue(c1.recv(1024) == "", "Idle client socket was not closed.")
+
+        c2.close()
+
+class Test8(TestBase):
+    def test_rooms(self):
+        clients = [self.newClient() for i in range(3)]
+        files = [c.makefile() for c in clients]
+        for f in files:
+            f.readline()
+
+        for i in [0, 2]:
+            clients[i].sendall("/join room1\n")
+            self.assertTrue(files[i].readline() == "joined room1\n")
+
+        clients[0].sendall("test1\n")
+        clients[1].sendall("test2\n")
+        for i in [0, 2]:
+            self.assertTrue(files[i].readline().endswith("test1\n"))
+        self.assertTrue(files[1].readline().endswith("test2\n"), "Lobby received a message from a room.")
+
+        clients[2].sendall("/leave\n")
+        self.assertTrue(files[2].readline() == "left room1\n")
+        clients[1].sendall("test3\n")
+        self.assertTrue(files[1].readline().endswith("test3\n"))
+        self.assertTrue(files[2].readline().endswith("test3\n"))
+
+        for c in clients:
+            c.close()
+
+    #Joining the room one is alone in again must not give the room away.
+    def test_rejoin(self):
+        c1 = self.newClient()
+        c1f = c1.makefile()
+        c2 = self.newClient()
+        c2f = c2.makefile()
+        c1f.readline()
+        c2f.readline()
+
+        for i in range(2):
+            c1.sendall("/join room1\n")
+            self.assertTrue(c1f.readline() == "joined room1\n")
+        c2.sendall("/join room2\n")
+        self.assertTrue(c2f.readline() == "joined room2\n")
+        c2.sendall("test1\n")
+        self.assertTrue(c2f.readline().endswith("test1\n"))
+
+        c1.settimeout(0.2)
+        self.assertRaises(socket.timeout, c1.recv, 100)
+        c1.sendall("test2\n")
+        c1.settimeout(None)
+        self.assertTrue(c1f.readline().endswith("test2\n"), "Client lost its room after joining it again.")
+        c1.close()
+        c2.close()
+
+
+class Test9(TestBase):
+    Args = ["-w", "1"]
+
+    def test_slowReader(self):
+        c1 = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        c1.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        c1.connect((IP, Port))
+        c2 = self.newClient()
+        c2.settimeout(None)
+
+        stop = threading.Event()
+        def drain():
+            try:
+                while not stop.is_set() and c2.recv(1 << 20):
+                    pass
+            except socket.error:
+                pass
+        reader = threading.Thread(target=drain)
+        reader.start()
+
+        chunk = ("x" * 1000 + "\n") * 16
+        for i in range(2000):
+            c2.sendall(chunk)
+            time.sleep(0.001)
+            if self.reader.countString("connection terminated"):
+                break
+
+        self.assertTrue(waitFor(lambda: self.reader.countString("connection terminated") == 1, timeout=3),
+            "Client that does not read was not disconnected.")
+        stop.set()
+        c2.shutdown(socket.SHUT_RDWR)
+        c2.close()
+        reader.join()
+        c1.close()
+
+#The echo and broadcast tests again on the io_uring backend (the server
+#falls back to epoll where io_uring is not available).
+class Test10(Test5):
+    Args = ["-u"]
+
+class Test11(Test6):
+    Args = ["-u"]
+
+#Two federated servers: this one on 3100 and a second one on 3101.
+class Test12(TestBase):
+    Args = ["-P", "127.0.0.1:3101"]
+
+    def setUp(self):
+        TestBase.setUp(self)
+        self.peer = subprocess.Popen(Cmdline + ["-p", "3101", "-P", "127.0.0.1:3100"], stdout=subprocess.PIPE)
+        self.peerReader = PipeReader(self.peer.stdout)
+
+    def tearDown(self):
+        self.peer.kill()
+        self.peerReader.join()
+        TestBase.tearDown(self)
+
+    def newPeerClient(self):
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.connect((IP, 3101))
+        return s
+
+    def test_federation(self):
+        self.assertTrue(waitFor(lambda: self.reader.countString(" up\n") == 1 and
+                                        self.peerReader.countString(" up\n") == 1, timeout=3),
+            "Peer links did not come up.")
+
+        c1 = self.newClient()
+        c1f = c1.makefile()
+        c2 = self.newPeerClient()
+        c2f = c2.makefile()
+        c1f.readline()
+        c2f.readline()
+
+        c1.sendall("from1\n")
+        self.assertTrue(c2f.readline() == "from1\n", "Message did not cross the link.")
+        c2.sendall("from2\n")
+        self.assertTrue(c2f.readline() == "from2\n")
+        for l in [c1f.readline(), c1f.readline()]:
+            self.assertTrue(l in ["from1\n", "from2\n"], "Unexpected message '{0}'".format(l))
+
+        c2.sendall("/join r\n")
+        self.assertTrue(c2f.readline() == "joined r\n")
+        c1.sendall("/join r\n")
+        self.assertTrue(c1f.readline() == "joined r\n")
+        c1.sendall("in r\n")
+        self.assertTrue(c2f.readline() == "in r\n", "Room message did not cross the link.")
+
+        c2.settimeout(0.2)
+        self.assertRaises(socket.timeout, c2.recv, 100)
+        c1.close()
+        c2.close()
+
+class Test13(TestBase):
+    Args = ["-r", "10"]
+
+    def test_rateLimit(self):
+        c1 = self.newClient()
+        c1f = c1.makefile()
+        c1f.readline()
+
+        c1.sendall("".join("limited%d\n" % i for i in range(30)))
+        time.sleep(0.5)
+        self.assertTrue(self.reader.countString("limited") <= 20,
+            "Rate limit did not hold back the burst.")
+
+        self.assertTrue(waitFor(lambda: self.reader.countString("limited") == 30, timeout=4),
+            "Throttled messages were not delivered.")
+        for i in range(30):
+            self.assertTrue(c1f.readline() == "limited%d\n" % i, "Messages out of order.")
+        self.assertTrue(self.reader.countString("connection terminated") == 0,
+            "Throttled client was disconnected.")
+        c1.close()
+
+def varint(n):
+    out = ""
+    while n >= 0x80:
+        out += chr(n & 0x7f | 0x80)
+        n >>= 7
+    return out + chr(n)
+
+class Test14(TestBase):
+    def test_binaryMode(self):
+        c1 = self.newClient()
+        c1f = c1.makefile()
+        c2 = self.newClient()
+        c2f = c2.makefile()
+        c1f.readline()
+        c2f.readline()
+
+        long = "x" * 300
+        c1.sendall("/binary\n" + varint(5) + "hello" + varint(300)[0])
+        self.assertTrue(c1f.readline() == "binary ok\n", "Binary mode was not confirmed.")
+        time.sleep(0.05)
+        c1.sendall(varint(300)[1] + long)
+
+        self.assertTrue(c2f.readline() == "hello\n", "Frame was not translated for a text client.")
+        self.assertTrue(c2f.readline() == long + "\n", "Frame was not translated for a text client.")
+        self.assertTrue(c1f.read(6) == varint(5) + "hello", "Frame was not echoed.")
+        self.assertTrue(c1f.read(302) == varint(300) + long, "Frame was not echoed.")
+
+        c2.sendall("from text\n")
+        self.assertTrue(c1f.read(10) == varint(9) + "from text", "Line was not framed for a binary client.")
+
+        c1.sendall(varint(2000))
+        self.assertTrue(waitFor(lambda: self.reader.countString("connection terminated: bad frame") == 1),
+            "Oversized frame was accepted.")
+        c1.close()
+        c2.close()
+
+#Hot restart: a second server with the same control socket takes over the
+#clients of the first one, which then exits.
+class Test15(TestBase):
+    Args = ["-H", "/tmp/chatsrv-test.sock"]
+
+    def tearDown(self):
+        if hasattr(self, "successor"):
+            self.successor.kill()
+            self.successorReader.join()
+        TestBase.tearDown(self)
+
+    def test_handoff(self):
+        c1 = self.newClient()
+        c1f = c1.makefile()
+        c2 = self.newClient()
+        c2f = c2.makefile()
+        c1f.readline()
+        c2f.readline()
+        c1.sendall("/join r\n")
+        c2.sendall("/join r\n")
+        self.assertTrue(c1f.readline() == "joined r\n")
+        self.assertTrue(c2f.readline() == "joined r\n")
+        c1.sendall("hal")
+        time.sleep(0.05)
+
+        self.successor = subprocess.Popen(Cmdline + self.Args, stdout=subprocess.PIPE)
+        self.successorReader = PipeReader(self.successor.stdout)
+        self.assertTrue(waitFor(lambda: self.successorReader.countString("took over 2 connections") == 1, timeout=2),
+            "Connections were not taken over.")
+        self.assertTrue(waitFor(lambda: self.server.poll() is not None, timeout=2),
+            "Old server did not exit.")
+        self.assertTrue(self.reader.countString("handed off 2 connections") == 1)
+
+        c1.sendall("f\n")
+        self.assertTrue(c2f.readline() == "half\n", "Partial line was lost in the handoff.")
+        self.assertTrue(c1f.readline() == "half\n")
+
+        c3 = self.newClient()
+        c3f = c3.makefile()
+        self.assertTrue(c3f.readline() == "Welcome\n", "New server does not accept.")
+        c3.sendall("lobby\n")
+        self.assertTrue(c3f.readline() == "lobby\n")
+        c2.settimeout(0.2)
+        self.assertRaises(socket.timeout, c2.recv, 100)
+
+        self.assertTrue(self.reader.countString("connection terminated") == 0 and
+                        self.successorReader.countString("connection terminated") == 0,
+            "A client was disconnected.")
+        c1.close()
+        c2.close()
+        c3.close()
+
+class Test16(Test15):
+    Args = ["-u", "-H", "/tmp/chatsrv-test.sock"]
+
+class Test17(TestBase):
+    Args = ["-c", "2"]
+
+    def test_maxConnections(self):
+        c1 = self.newClient()
+        c1f = c1.makefile()
+        c2 = self.newClient()
+        c2f = c2.makefile()
+        self.assertTrue(c1f.readline() == "Welcome\n")
+        self.assertTrue(c2f.readline() == "Welcome\n")
+
+        c3 = self.newClient()
+        self.assertTrue(c3.recv(100) == "", "Connection over the limit was not closed.")
+        self.assertTrue(waitFor(lambda: self.reader.countString("accepted connection") == 2))
+
+        c1f.close()
+        c1.close()
+        self.assertTrue(waitFor(lambda: self.reader.countString("connection terminated") == 1))
+        c4 = self.newClient()
+        self.assertTrue(c4.makefile().readline() == "Welcome\n", "Freed slot was not reused.")
+        c2.close()
+        c3.close()
+        c4.close()
+
+class Test18(Test17):
+    Args = ["-u", "-c", "2"]
+
+#A throttled client that resets its connection is dropped right away, not
+#when its reads would resume about a second later.
+class Test19(TestBase):
+    Args = ["-r", "1"]
+
+    def test_resetWhileThrottled(self):
+        c1 = self.newClient()
+        c1.makefile().readline()
+
+        c1.sendall("".join("limited%d\n" % i for i in range(10)))
+        time.sleep(0.1)
+        c1.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+        c1.close()
+        self.assertTrue(waitFor(lambda: self.reader.countString("connection terminated") == 1, timeout=0.5),
+            "Reset of a throttled client was not noticed.")
+
+class Test20(TestBase):
+    #Without -P nobody may open a federation link; the client stays a client.
+    def test_peerRefused(self):
+        c1 = self.newClient()
+        c1f = c1.makefile()
+        c1f.readline()
+
+        c1.sendall("/peer 12345\n")
+        self.assertTrue(c1f.readline() == "usage: /peer <origin>\n", "Unconfigured peer was accepted.")
+        c1.sendall("still chatting\n")
+        self.assertTrue(c1f.readline() == "still chatting\n")
+        self.assertTrue(self.reader.countString("peer link from") == 0)
+        c1.close()
 
 if __name__ == '__main__':
     unittest.main()
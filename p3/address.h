@@ -0,0 +1,25 @@
+#ifndef PROXY_ADDRESS_H
+#define PROXY_ADDRESS_H
+
+#include <iostream>
+#include <string>
+
+//HOST:PORT Address structure
+struct Address {
+    unsigned short port;
+    std::string host;
+    Address(std::string hostport) {
+        std::size_t found = hostport.find(":");
+        if (found != std::string::npos) {
+            host = hostport.substr(0, found);
+            port = std::stoi(hostport.substr(found + 1));
+        }
+        else {
+            std::cerr << "Port wasn't found in " << hostport << "! Using port 80 instead." << std::endl;
+            host = hostport;
+            port = 80;
+        }
+    }
+};
+
+#endif //PROXY_ADDRESS_H
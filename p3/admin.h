@@ -0,0 +1,112 @@
+#ifndef PROXY_ADMIN_H
+#define PROXY_ADMIN_H
+
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "metrics.h"
+
+//The metrics of the ports currently configured.
+typedef std::function<std::vector<const Metrics*>()> MetricsSource;
+
+//An accept that failed for want of file descriptors fails again at once;
+//acceptors wait this long before the next one.
+const unsigned accept_pause_ms = 100;
+
+inline bool out_of_descriptors(const boost::system::error_code& error) {
+    return error == boost::system::errc::too_many_files_open
+           || error == boost::system::errc::too_many_files_open_in_system;
+}
+
+//Admin endpoint on 127.0.0.1: every connection gets the current metrics
+//of all ports as text and is closed, so `nc localhost PORT` is enough.
+class AdminServer {
+public:
+    typedef boost::asio::ip::tcp tcp;
+
+    AdminServer(boost::asio::io_service& io_service, unsigned short port, const MetricsSource& metrics)
+    : io_service_(io_service), acceptor_(io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), port)),
+      pause_(io_service), metrics_(metrics) {
+        accept();
+    }
+
+private:
+    struct Reply {
+        explicit Reply(boost::asio::io_service& io_service) : socket(io_service) {}
+
+        tcp::socket socket;
+        std::string text;
+    };
+
+    void accept() {
+        std::shared_ptr<Reply> reply(new Reply(io_service_));
+        acceptor_.async_accept(reply->socket, boost::bind(&AdminServer::handle_accept, this, reply,
+                                                          boost::asio::placeholders::error));
+    }
+
+    void handle_accept(std::shared_ptr<Reply> reply, const boost::system::error_code& error) {
+        if (error == boost::asio::error::operation_aborted || !acceptor_.is_open())
+            return;
+        if (error) {
+            std::cerr << "Admin error: " << error.message() << std::endl;
+            if (out_of_descriptors(error)) {
+                pause_.expires_from_now(std::chrono::milliseconds(accept_pause_ms));
+                pause_.async_wait([this](const boost::system::error_code&) { accept(); });
+            }
+            else
+                accept();
+            return;
+        }
+        std::ostringstream text;
+        for (const Metrics* metrics : metrics_())
+            metrics->report(text);
+        reply->text = text.str();
+        boost::asio::async_write(reply->socket, boost::asio::buffer(reply->text),
+                                 [reply](const boost::system::error_code&, size_t) {});
+        accept();
+    }
+
+    boost::asio::io_service& io_service_;
+    tcp::acceptor acceptor_;
+    boost::asio::steady_timer pause_;
+    MetricsSource metrics_;
+};
+
+//Writes the metrics of all ports to stderr every `seconds`.
+class MetricsDump {
+public:
+    MetricsDump(boost::asio::io_service& io_service, unsigned seconds, const MetricsSource& metrics)
+    : timer_(io_service), seconds_(seconds), metrics_(metrics) {
+        schedule();
+    }
+
+private:
+    void schedule() {
+        timer_.expires_from_now(std::chrono::seconds(seconds_));
+        timer_.async_wait(boost::bind(&MetricsDump::dump, this, boost::asio::placeholders::error));
+    }
+
+    void dump(const boost::system::error_code& error) {
+        if (error)
+            return;
+        std::ostringstream text;
+        for (const Metrics* metrics : metrics_())
+            metrics->report(text);
+        std::cerr << text.str() << std::flush;
+        schedule();
+    }
+
+    boost::asio::steady_timer timer_;
+    unsigned seconds_;
+    MetricsSource metrics_;
+};
+
+#endif //PROXY_ADMIN_H
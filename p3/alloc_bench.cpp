@@ -0,0 +1,234 @@
+/*
+ Counts the heap allocations the proxy makes while sessions forward
+ traffic, to check that the hot path does none once a session is up.
+
+   alloc_bench [-c CLIENTS] [-n ROUND_TRIPS] [-l LENGTH] [-z]
+
+ An echo backend and the clients run on threads of their own with blocking
+ sockets. Only allocations on the thread that runs the sessions count:
+ first while the clients connect and warm up, then over the measured round
+ trips, where the number per round trip should be 0.
+ */
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <boost/asio.hpp>
+
+#include "config.h"
+#include "route.h"
+#include "session.h"
+
+static std::atomic<uint64_t> allocations(0);
+static thread_local bool counting = false;
+
+void* operator new(size_t size) {
+    if (counting)
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    void* pointer = malloc(size ? size : 1);
+    if (!pointer)
+        throw std::bad_alloc();
+    return pointer;
+}
+
+void operator delete(void* pointer) noexcept {
+    free(pointer);
+}
+
+//Listening socket on 127.0.0.1 with a port the kernel picks.
+static int listen_any(unsigned short& port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (bind(fd, (sockaddr*)&address, length) == -1 || listen(fd, 128) == -1
+        || getsockname(fd, (sockaddr*)&address, &length) == -1) {
+        perror("backend");
+        exit(1);
+    }
+    port = ntohs(address.sin_port);
+    return fd;
+}
+
+static int connect_to(unsigned short port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) == -1) {
+        perror("client");
+        exit(1);
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+//Until all of `length` went, or the peer closed.
+static bool send_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = write(fd, data, length);
+        if (sent <= 0)
+            return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+static bool receive_all(int fd, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t received = read(fd, data, length);
+        if (received <= 0)
+            return false;
+        data += received;
+        length -= received;
+    }
+    return true;
+}
+
+//Echo backend, a thread per connection.
+static void echo(int listener) {
+    for (;;) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd == -1)
+            return;
+        std::thread([fd]() {
+            char data[65536];
+            ssize_t received;
+            while ((received = read(fd, data, sizeof(data))) > 0) {
+                if (!send_all(fd, data, received))
+                    break;
+            }
+            close(fd);
+        }).detach();
+    }
+}
+
+//Proxy side: sessions on one io_service, as on one thread of the server.
+class Proxy {
+public:
+    Proxy(boost::asio::io_service& io_service, unsigned short backend_port, const SessionOptions& options)
+    : io_service_(io_service), acceptor_(io_service, tcp::endpoint(address_v4::loopback(), 0)),
+      options_(options) {
+        PortConfig config;
+        config.destinations.push_back(Destination("127.0.0.1:" + std::to_string(backend_port)));
+        config.health.interval_ms = 0;
+        route_ = std::make_shared<Route>(config, io_service, 1);
+        accept();
+    }
+
+    unsigned short port() const { return acceptor_.local_endpoint().port(); }
+
+private:
+    void accept() {
+        boost::shared_ptr<Session> session(new Session(io_service_, route_, 0, options_, nullptr));
+        acceptor_.async_accept(session->client_stream_socket(),
+                               [this, session](const boost::system::error_code& error) {
+                                   if (error)
+                                       return;
+                                   session->start();
+                                   accept();
+                               });
+    }
+
+    boost::asio::io_service& io_service_;
+    tcp::acceptor acceptor_;
+    SessionOptions options_;
+    std::shared_ptr<Route> route_;
+};
+
+int main(int argc, char* argv[]) {
+    size_t clients = 4, round_trips = 20000, length = 1024;
+    SessionOptions options;
+    int option;
+    while ((option = getopt(argc, argv, "c:n:l:z")) != -1) {
+        switch (option) {
+            case 'c': clients = std::max(1, atoi(optarg)); break;
+            case 'n': round_trips = std::max(1, atoi(optarg)); break;
+            case 'l': length = std::max(1, atoi(optarg)); break;
+            case 'z': options.splice = true; break;
+            default:
+                std::cerr << "Usage: alloc_bench [-c CLIENTS] [-n ROUND_TRIPS] [-l LENGTH] [-z]" << std::endl;
+                return 1;
+        }
+    }
+
+    unsigned short backend_port;
+    int listener = listen_any(backend_port);
+    std::thread(echo, listener).detach();
+
+    boost::asio::io_service io_service(1);
+    Proxy proxy(io_service, backend_port, options);
+    boost::asio::io_service::work work(io_service);
+    std::thread runner([&io_service]() {
+        counting = true;
+        io_service.run();
+    });
+
+    //Every client warms up with a few round trips, then all start the
+    //measured ones together.
+    const size_t warm_up = 100;
+    std::atomic<size_t> ready(0);
+    std::atomic<bool> go(false);
+    std::atomic<size_t> failed(0);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < clients; ++i) {
+        threads.emplace_back([&, i]() {
+            int fd = connect_to(proxy.port());
+            std::vector<char> request(length, char('a' + i % 26)), reply(length);
+            bool ok = true;
+            for (size_t n = 0; ok && n < warm_up; ++n)
+                ok = send_all(fd, request.data(), length) && receive_all(fd, reply.data(), length);
+            ++ready;
+            while (!go)
+                std::this_thread::yield();
+            for (size_t n = 0; ok && n < round_trips; ++n)
+                ok = send_all(fd, request.data(), length) && receive_all(fd, reply.data(), length)
+                     && reply == request;
+            if (!ok)
+                ++failed;
+            close(fd);
+        });
+    }
+    while (ready < clients)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    uint64_t setup = allocations;
+    auto started = std::chrono::steady_clock::now();
+    go = true;
+    for (auto& thread : threads)
+        thread.join();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    uint64_t forwarding = allocations - setup;
+
+    uint64_t total = uint64_t(clients) * round_trips;
+    std::cout << clients << " clients, " << length << " byte messages" << (options.splice ? ", splice" : "") << "\n"
+              << "setup:      " << setup << " allocations\n"
+              << "forwarding: " << forwarding << " allocations in " << total << " round trips, "
+              << double(forwarding) / total << " per round trip\n"
+              << "            " << int(total / seconds) << " round trips/s\n";
+    if (failed > 0)
+        std::cout << failed << " clients failed" << std::endl;
+
+    io_service.stop();
+    runner.join();
+    return failed > 0 ? 1 : 0;
+}
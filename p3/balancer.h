@@ -0,0 +1,340 @@
+#ifndef PROXY_BALANCER_H
+#define PROXY_BALANCER_H
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "address.h"
+
+//A destination of one listen port, at position `index` in its list.
+//`active` counts its live sessions, `failures` its consecutive failed
+//connects; `ejected` is set by the health checks. All are shared by all
+//threads.
+struct Backend {
+    Backend(const Address& address, unsigned weight, size_t index)
+    : address(address), weight(weight), index(index), active(0), failures(0), ejected(false),
+      endpoint(boost::asio::ip::address::from_string(address.host), address.port) {}
+
+    Address address;
+    unsigned weight;
+    size_t index;
+    std::atomic<unsigned> active;
+    std::atomic<unsigned> failures;
+    std::atomic<bool> ejected;
+    boost::asio::ip::tcp::endpoint endpoint;
+};
+
+//Picks the backend for a new session. Called from every thread; pick() is
+//paired with a release() when the session ends.
+//
+//Ejected backends, and the one to `avoid` (that a retry comes from), are
+//skipped by each policy in its own terms: the next in turn, the next
+//lowest load, the next point on the ring. With none usable the policy's
+//first choice stands.
+class Balancer {
+public:
+    typedef boost::asio::ip::tcp::endpoint endpoint;
+
+    explicit Balancer(std::vector<std::unique_ptr<Backend>>& backends) : backends_(backends) {}
+    virtual ~Balancer() {}
+
+    Backend* pick(const endpoint& client, const Backend* avoid = nullptr) {
+        Backend* backend = choose(client, avoid);
+        backend->active.fetch_add(1, std::memory_order_relaxed);
+        picked(backend);
+        return backend;
+    }
+
+    void release(Backend* backend) {
+        backend->active.fetch_sub(1, std::memory_order_relaxed);
+        released(backend);
+    }
+
+    //"random", "round_robin", "weighted", "least_active", "p2c" or "hash";
+    //nullptr for an unknown name.
+    static Balancer* create(const std::string& policy, std::vector<std::unique_ptr<Backend>>& backends);
+
+protected:
+    virtual Backend* choose(const endpoint& client, const Backend* avoid) = 0;
+    virtual void picked(Backend*) {}
+    virtual void released(Backend*) {}
+
+    static bool usable(const Backend* backend, const Backend* avoid) {
+        return backend != avoid && !backend->ejected.load(std::memory_order_relaxed);
+    }
+
+    //Greatest common divisor of the weights: the weighted tables are built
+    //for the weights divided by it.
+    unsigned weight_divisor() const {
+        unsigned divisor = 0;
+        for (auto& backend : backends_) {
+            unsigned a = backend->weight, b = divisor;
+            while (b != 0) {
+                unsigned rest = a % b;
+                a = b;
+                b = rest;
+            }
+            divisor = a;
+        }
+        return std::max(divisor, 1u);
+    }
+
+    //Per-thread generator, seeded once per thread.
+    static std::minstd_rand& random() {
+        static thread_local std::minstd_rand generator(std::random_device{}());
+        return generator;
+    }
+
+    std::vector<std::unique_ptr<Backend>>& backends_;
+};
+
+//The original policy: uniform at random, over the usable backends.
+class RandomBalancer : public Balancer {
+public:
+    using Balancer::Balancer;
+
+protected:
+    Backend* choose(const endpoint&, const Backend* avoid) {
+        Backend* backend = backends_[random()() % backends_.size()].get();
+        if (usable(backend, avoid))
+            return backend;
+        size_t count = std::count_if(backends_.begin(), backends_.end(),
+                                     [avoid](const std::unique_ptr<Backend>& b) { return usable(b.get(), avoid); });
+        if (count == 0)
+            return backend;
+        size_t skip = random()() % count;
+        for (auto& other : backends_) {
+            if (usable(other.get(), avoid) && skip-- == 0)
+                return other.get();
+        }
+        return backend;
+    }
+};
+
+class RoundRobinBalancer : public Balancer {
+public:
+    explicit RoundRobinBalancer(std::vector<std::unique_ptr<Backend>>& backends) : Balancer(backends), next_(0) {}
+
+protected:
+    //An unusable backend passes its turn to the next one in order.
+    Backend* choose(const endpoint&, const Backend* avoid) {
+        size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < backends_.size(); ++i) {
+            Backend* backend = backends_[(start + i) % backends_.size()].get();
+            if (usable(backend, avoid))
+                return backend;
+        }
+        return backends_[start % backends_.size()].get();
+    }
+
+private:
+    std::atomic<size_t> next_;
+};
+
+//Weighted round-robin without a lock: the smooth weighted order (nginx
+//style, no bursts to one backend) is worked out once for a full cycle of
+//sum(weights) picks and then walked with an atomic counter. The weights
+//are divided by their common divisor first, so 100 and 300 cost no more
+//than 1 and 3; the settings keep each weight at most 1000.
+class WeightedBalancer : public Balancer {
+public:
+    explicit WeightedBalancer(std::vector<std::unique_ptr<Backend>>& backends) : Balancer(backends), next_(0) {
+        unsigned divisor = weight_divisor();
+        long total = 0;
+        for (auto& backend : backends_)
+            total += backend->weight / divisor;
+        std::vector<long> current(backends_.size(), 0);
+        for (long turn = 0; turn < total; ++turn) {
+            size_t best = 0;
+            for (size_t i = 0; i < backends_.size(); ++i) {
+                current[i] += backends_[i]->weight / divisor;
+                if (current[i] > current[best])
+                    best = i;
+            }
+            current[best] -= total;
+            schedule_.push_back(backends_[best].get());
+        }
+    }
+
+protected:
+    //An unusable backend passes its turn to the next one in the cycle.
+    Backend* choose(const endpoint&, const Backend* avoid) {
+        size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+        for (size_t i = 0; i < schedule_.size(); ++i) {
+            Backend* backend = schedule_[(start + i) % schedule_.size()];
+            if (usable(backend, avoid))
+                return backend;
+        }
+        return schedule_[start % schedule_.size()];
+    }
+
+private:
+    std::vector<Backend*> schedule_;
+    std::atomic<size_t> next_;
+};
+
+//Fewest live sessions, relative to the weight. The backends are kept
+//ordered by load, so a pick and a release are O(log n) under a short lock
+//(plus a step per unusable backend ahead in the order).
+class LeastActiveBalancer : public Balancer {
+public:
+    explicit LeastActiveBalancer(std::vector<std::unique_ptr<Backend>>& backends) : Balancer(backends) {
+        for (size_t i = 0; i < backends_.size(); ++i)
+            order_.insert(Entry(0, i));
+        load_.assign(backends_.size(), 0);
+    }
+
+protected:
+    Backend* choose(const endpoint&, const Backend* avoid) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& entry : order_) {
+            if (usable(backends_[entry.second].get(), avoid))
+                return backends_[entry.second].get();
+        }
+        return backends_[order_.begin()->second].get();
+    }
+
+    void picked(Backend* backend) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        move(backend->index, +1);
+    }
+
+    void released(Backend* backend) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        move(backend->index, -1);
+    }
+
+private:
+    typedef std::pair<double, size_t> Entry;    //sessions per weight, backend
+
+    void move(size_t i, int delta) {
+        order_.erase(Entry(double(load_[i]) / backends_[i]->weight, i));
+        load_[i] += delta;
+        order_.insert(Entry(double(load_[i]) / backends_[i]->weight, i));
+    }
+
+    std::mutex mutex_;
+    std::set<Entry> order_;
+    std::vector<long> load_;
+};
+
+//Power of two choices: the less loaded of two random backends. Nearly as
+//even as least-active, with no shared state beyond the session counters.
+//If neither of the two is usable, the least loaded usable one is taken.
+class TwoChoicesBalancer : public Balancer {
+public:
+    using Balancer::Balancer;
+
+protected:
+    Backend* choose(const endpoint&, const Backend* avoid) {
+        size_t n = backends_.size();
+        if (n == 1)
+            return backends_[0].get();
+        size_t a = random()() % n;
+        size_t b = (a + 1 + random()() % (n - 1)) % n;
+        Backend* first = backends_[a].get();
+        Backend* second = backends_[b].get();
+        if (usable(first, avoid) != usable(second, avoid))
+            return usable(first, avoid) ? first : second;
+        if (!usable(first, avoid)) {
+            Backend* least = nullptr;
+            for (auto& backend : backends_) {
+                if (usable(backend.get(), avoid) && (!least || less_loaded(backend.get(), least)))
+                    least = backend.get();
+            }
+            return least ? least : first;
+        }
+        return less_loaded(second, first) ? second : first;
+    }
+
+private:
+    static bool less_loaded(const Backend* a, const Backend* b) {
+        return a->active.load(std::memory_order_relaxed) * b->weight
+               < b->active.load(std::memory_order_relaxed) * a->weight;
+    }
+};
+
+//Consistent hashing of the client address: a client keeps its backend, and
+//a change in the backend set moves only the clients of the changed
+//backend. Each backend has virtual_nodes points per unit of weight (over
+//the weights' common divisor) on the ring; a pick is a binary search, and
+//the clients of an unusable backend go to the next backend along the ring.
+class HashBalancer : public Balancer {
+public:
+    enum { virtual_nodes = 100 };
+
+    explicit HashBalancer(std::vector<std::unique_ptr<Backend>>& backends) : Balancer(backends) {
+        unsigned divisor = weight_divisor();
+        for (auto& backend : backends_) {
+            std::string key = backend->address.host + ":" + std::to_string(backend->address.port);
+            for (unsigned i = 0; i < virtual_nodes * (backend->weight / divisor); ++i)
+                ring_.push_back(std::make_pair(hash(key + "#" + std::to_string(i)), backend.get()));
+        }
+        std::sort(ring_.begin(), ring_.end());
+    }
+
+protected:
+    Backend* choose(const endpoint& client, const Backend* avoid) {
+        std::string key;
+        if (client.address().is_v4()) {
+            auto bytes = client.address().to_v4().to_bytes();
+            key.assign(bytes.begin(), bytes.end());
+        }
+        else {
+            auto bytes = client.address().to_v6().to_bytes();
+            key.assign(bytes.begin(), bytes.end());
+        }
+        size_t found = std::lower_bound(ring_.begin(), ring_.end(), std::make_pair(hash(key), (Backend*)nullptr))
+                       - ring_.begin();
+        for (size_t i = 0; i < ring_.size(); ++i) {
+            Backend* backend = ring_[(found + i) % ring_.size()].second;
+            if (usable(backend, avoid))
+                return backend;
+        }
+        return ring_[found % ring_.size()].second;
+    }
+
+private:
+    //FNV-1a with a final mix, so that similar addresses spread.
+    static uint64_t hash(const std::string& key) {
+        uint64_t h = 14695981039346656037ull;
+        for (unsigned char c : key) {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+
+    std::vector<std::pair<uint64_t, Backend*>> ring_;
+};
+
+inline Balancer* Balancer::create(const std::string& policy, std::vector<std::unique_ptr<Backend>>& backends) {
+    if (policy == "random")
+        return new RandomBalancer(backends);
+    if (policy == "round_robin")
+        return new RoundRobinBalancer(backends);
+    if (policy == "weighted")
+        return new WeightedBalancer(backends);
+    if (policy == "least_active")
+        return new LeastActiveBalancer(backends);
+    if (policy == "p2c")
+        return new TwoChoicesBalancer(backends);
+    if (policy == "hash")
+        return new HashBalancer(backends);
+    return nullptr;
+}
+
+#endif //PROXY_BALANCER_H
@@ -0,0 +1,184 @@
+#ifndef PROXY_CONFIG_H
+#define PROXY_CONFIG_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "address.h"
+#include "health.h"
+
+//Connecting to backends, per port. A timeout of 0 leaves it to the kernel.
+struct ConnectOptions {
+    unsigned timeout_ms = 1000;         //per attempt
+    unsigned attempts = 3;              //each to a different backend than the last
+    unsigned budget_ms = 3000;          //for all attempts together
+};
+
+//Destination of a listen port as written in the settings: HOST:PORT, or
+//HOST:PORT*WEIGHT for the weighted policies, with WEIGHT from 1 to
+//max_weight. Throws std::runtime_error for a weight out of that range;
+//the balancers' tables grow with the weights.
+struct Destination {
+    enum { max_weight = 1000 };
+
+    Address address;
+    unsigned weight;
+    Destination(std::string text) : address(text.substr(0, text.find('*'))), weight(1) {
+        std::size_t star = text.find('*');
+        if (star != std::string::npos) {
+            char* end = nullptr;
+            long value = strtol(text.c_str() + star + 1, &end, 10);
+            if (*end != '\0' || value < 1 || value > max_weight)
+                throw std::runtime_error("weight of " + text + " is not a number from 1 to "
+                                         + std::to_string(int(max_weight)));
+            weight = unsigned(value);
+        }
+    }
+};
+
+//Everything the settings say about one listen port. `text` is the port's
+//settings in a normal form, to tell on a reload whether it changed.
+struct PortConfig {
+    unsigned short port = 0;
+    std::vector<Destination> destinations;
+    std::string policy = "random";
+    HealthOptions health;
+    ConnectOptions connect;
+    std::string text;
+};
+
+//The settings file. One port per line, as in the task:
+//
+//    <src_port>,<dst1>,<dst2>,...
+//
+//where a field may also be policy=NAME or a NAME=NUMBER setting of the
+//health checks or of connecting. Blank lines and lines starting with '#'
+//are skipped. A file without commas is the older form, one port for the
+//whole file: the port, then destinations and settings separated by
+//whitespace.
+class Config {
+public:
+    //Throws std::runtime_error with what is wrong.
+    static std::vector<PortConfig> load(const std::string& path) {
+        std::ifstream file(path.c_str());
+        if (!file.is_open())
+            throw std::runtime_error("can't open " + path);
+        std::stringstream contents;
+        contents << file.rdbuf();
+        std::string text = contents.str();
+
+        std::vector<PortConfig> ports;
+        if (text.find(',') == std::string::npos) {
+            std::istringstream words(text);
+            std::vector<std::string> fields;
+            std::string word;
+            while (words >> word)
+                fields.push_back(word);
+            if (!fields.empty())
+                ports.push_back(parse_port(fields));
+        }
+        else {
+            std::istringstream lines(text);
+            std::string line;
+            while (std::getline(lines, line)) {
+                std::vector<std::string> fields = split(line);
+                if (!fields.empty() && fields[0][0] != '#')
+                    ports.push_back(parse_port(fields));
+            }
+        }
+
+        std::set<unsigned short> seen;
+        for (auto& port : ports) {
+            if (!seen.insert(port.port).second)
+                throw std::runtime_error("port " + std::to_string(port.port) + " is listed twice");
+        }
+        if (ports.empty())
+            throw std::runtime_error("no ports in " + path);
+        return ports;
+    }
+
+private:
+    //Comma separated, blanks around the fields dropped.
+    static std::vector<std::string> split(const std::string& line) {
+        std::vector<std::string> fields;
+        std::istringstream stream(line);
+        std::string field;
+        while (std::getline(stream, field, ',')) {
+            size_t first = field.find_first_not_of(" \t\r");
+            if (first == std::string::npos)
+                continue;
+            size_t last = field.find_last_not_of(" \t\r");
+            fields.push_back(field.substr(first, last - first + 1));
+        }
+        return fields;
+    }
+
+    static PortConfig parse_port(const std::vector<std::string>& fields) {
+        PortConfig config;
+        int port = atoi(fields[0].c_str());
+        if (port <= 0 || port > 65535)
+            throw std::runtime_error("bad listen port " + fields[0]);
+        config.port = port;
+        config.text = fields[0];
+        for (size_t i = 1; i < fields.size(); ++i) {
+            const std::string& field = fields[i];
+            if (field.compare(0, 7, "policy=") == 0)
+                config.policy = field.substr(7);
+            else if (!parse_health(field, config.health) && !parse_connect(field, config.connect)) {
+                if (field.find(':') == std::string::npos)
+                    throw std::runtime_error("bad destination " + field + " for port " + fields[0]);
+                config.destinations.push_back(Destination(field));
+            }
+            config.text += "," + field;
+        }
+        config.health.failures = std::max(1u, config.health.failures);
+        if (config.destinations.empty())
+            throw std::runtime_error("no destinations for port " + fields[0]);
+        return config;
+    }
+
+    //NAME=NUMBER settings; false if `token` is none of them.
+    template <class Options, size_t count>
+    static bool parse_setting(const std::string& token, Options& options,
+                              const std::pair<const char*, unsigned Options::*> (&settings)[count]) {
+        for (auto& setting : settings) {
+            size_t length = strlen(setting.first);
+            if (token.compare(0, length, setting.first) == 0) {
+                options.*setting.second = std::max(0, atoi(token.c_str() + length));
+                return true;
+            }
+        }
+        return false;
+    }
+
+    static bool parse_health(const std::string& token, HealthOptions& health) {
+        static const std::pair<const char*, unsigned HealthOptions::*> settings[] = {
+            { "check_ms=", &HealthOptions::interval_ms },
+            { "check_timeout_ms=", &HealthOptions::timeout_ms },
+            { "eject_failures=", &HealthOptions::failures },
+            { "eject_slow_ms=", &HealthOptions::slow_ms },
+            { "eject_ms=", &HealthOptions::eject_ms },
+            { "max_eject_ms=", &HealthOptions::max_eject_ms },
+        };
+        return parse_setting(token, health, settings);
+    }
+
+    static bool parse_connect(const std::string& token, ConnectOptions& connect) {
+        static const std::pair<const char*, unsigned ConnectOptions::*> settings[] = {
+            { "connect_timeout_ms=", &ConnectOptions::timeout_ms },
+            { "connect_attempts=", &ConnectOptions::attempts },
+            { "connect_budget_ms=", &ConnectOptions::budget_ms },
+        };
+        return parse_setting(token, connect, settings);
+    }
+};
+
+#endif //PROXY_CONFIG_H
@@ -0,0 +1,87 @@
+#ifndef PROXY_HANDLER_MEMORY_H
+#define PROXY_HANDLER_MEMORY_H
+
+#include <stddef.h>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+//Memory for the operation of one handler at a time. asio takes it through
+//the handler's associated allocator when the operation starts and gives
+//it back before the handler runs, so the handler can start the next
+//operation in the same block. A second request while the block is taken,
+//or one too large for it, goes to the heap.
+class HandlerMemory {
+public:
+    HandlerMemory() : in_use_(false) {}
+    HandlerMemory(const HandlerMemory&) = delete;
+    HandlerMemory& operator=(const HandlerMemory&) = delete;
+
+    void* allocate(size_t size) {
+        if (!in_use_ && size <= sizeof(storage_)) {
+            in_use_ = true;
+            return &storage_;
+        }
+        return ::operator new(size);
+    }
+
+    void deallocate(void* pointer) {
+        if (pointer == &storage_)
+            in_use_ = false;
+        else
+            ::operator delete(pointer);
+    }
+
+private:
+    std::aligned_storage<512>::type storage_;
+    bool in_use_;
+};
+
+//Standard allocator over a HandlerMemory.
+template <typename T>
+class HandlerAllocator {
+public:
+    typedef T value_type;
+
+    explicit HandlerAllocator(HandlerMemory& memory) : memory_(memory) {}
+
+    template <typename U>
+    HandlerAllocator(const HandlerAllocator<U>& other) noexcept : memory_(other.memory_) {}
+
+    bool operator==(const HandlerAllocator& other) const noexcept { return &memory_ == &other.memory_; }
+    bool operator!=(const HandlerAllocator& other) const noexcept { return &memory_ != &other.memory_; }
+
+    T* allocate(size_t n) const { return static_cast<T*>(memory_.allocate(sizeof(T) * n)); }
+    void deallocate(T* pointer, size_t) const { memory_.deallocate(pointer); }
+
+private:
+    template <typename> friend class HandlerAllocator;
+
+    HandlerMemory& memory_;
+};
+
+//Handler whose operations live in `memory`; asio finds the allocator
+//through the nested allocator_type.
+template <typename Handler>
+class AllocHandler {
+public:
+    typedef HandlerAllocator<Handler> allocator_type;
+
+    AllocHandler(HandlerMemory& memory, Handler handler) : memory_(memory), handler_(std::move(handler)) {}
+
+    allocator_type get_allocator() const noexcept { return allocator_type(memory_); }
+
+    template <typename... Args>
+    void operator()(Args&&... args) { handler_(std::forward<Args>(args)...); }
+
+private:
+    HandlerMemory& memory_;
+    Handler handler_;
+};
+
+template <typename Handler>
+inline AllocHandler<Handler> make_alloc_handler(HandlerMemory& memory, Handler handler) {
+    return AllocHandler<Handler>(memory, std::move(handler));
+}
+
+#endif //PROXY_HANDLER_MEMORY_H
@@ -0,0 +1,207 @@
+#ifndef PROXY_HEALTH_H
+#define PROXY_HEALTH_H
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <vector>
+
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "balancer.h"
+
+//Settings of the health checks of one port.
+struct HealthOptions {
+    unsigned interval_ms = 2000;        //active probes; 0 turns them off
+    unsigned timeout_ms = 1000;         //a probe slower than this fails
+    unsigned failures = 3;              //consecutive failures that eject
+    unsigned slow_ms = 0;               //a slower connect counts as a failure; 0 is off
+    unsigned eject_ms = 1000;           //first ejection, doubled on every repeat
+    unsigned max_eject_ms = 30000;
+};
+
+//Health of the backends of one port.
+//
+//Passive: sessions report every connect to a backend. `failures` in a row
+//(failed, or slower than slow_ms) eject it. Active: every interval_ms a
+//TCP connect probe goes to each backend that is in service, and a failed
+//probe counts like a failed connect.
+//
+//An ejected backend is out of the balancer's choice until a probe after
+//the ejection time succeeds. A failed probe then ejects it again for twice
+//as long, up to max_eject_ms; a backend that stays in service that long
+//starts over from eject_ms.
+//
+//Reports come from every thread and touch only the backend's atomics. The
+//bookkeeping of ejections, the timers and the probes live on one
+//io_service, where start() and stop() are called too. The backends are
+//shared with the route: pending handlers keep the object alive and with it
+//the backends, also after the route is gone and before stop() has run.
+class Health : public std::enable_shared_from_this<Health> {
+public:
+    typedef boost::asio::ip::tcp tcp;
+    typedef std::chrono::steady_clock clock;
+
+    Health(boost::asio::io_service& io_service,
+           const std::shared_ptr<std::vector<std::unique_ptr<Backend>>>& backends, const HealthOptions& options)
+    : io_service_(io_service), backends_(backends), options_(options), timer_(io_service), stopped_(false) {
+        for (size_t i = 0; i < backends_->size(); ++i)
+            states_.emplace_back(new State(io_service_));
+    }
+
+    void start() {
+        if (options_.interval_ms > 0)
+            schedule_probes();
+    }
+
+    void stop() {
+        stopped_ = true;
+        boost::system::error_code ignored;
+        timer_.cancel(ignored);
+        for (auto& state : states_)
+            state->timer.cancel(ignored);
+    }
+
+    //From any thread, once per connect a session made.
+    void report(Backend* backend, bool connected, clock::duration elapsed) {
+        if (connected && (options_.slow_ms == 0 || elapsed < std::chrono::milliseconds(options_.slow_ms)))
+            backend->failures.store(0, std::memory_order_relaxed);
+        else
+            failed(backend);
+    }
+
+private:
+    struct State {
+        explicit State(boost::asio::io_service& io_service)
+        : timer(io_service), ejections(0), probing(false) {}
+
+        boost::asio::steady_timer timer;    //ejection
+        unsigned ejections;                 //in a row, for the backoff
+        clock::time_point readmitted;
+        bool probing;
+    };
+
+    //One connect attempt with a deadline; `done` runs once.
+    struct Probe {
+        Probe(boost::asio::io_service& io_service, std::function<void(bool)> done)
+        : socket(io_service), timer(io_service), done(done), finished(false) {}
+
+        tcp::socket socket;
+        boost::asio::steady_timer timer;
+        std::function<void(bool)> done;
+        bool finished;
+    };
+
+    void failed(Backend* backend) {
+        unsigned failures = backend->failures.fetch_add(1, std::memory_order_relaxed) + 1;
+        if (failures >= options_.failures && !backend->ejected.exchange(true))
+            io_service_.post(boost::bind(&Health::eject, shared_from_this(), backend));
+    }
+
+    void eject(Backend* backend) {
+        if (stopped_)
+            return;
+        State& state = *states_[backend->index];
+        if (clock::now() - state.readmitted > std::chrono::milliseconds(options_.max_eject_ms))
+            state.ejections = 0;
+        hold(backend);
+    }
+
+    //Out of service for the next step of the backoff.
+    void hold(Backend* backend) {
+        State& state = *states_[backend->index];
+        unsigned shift = std::min(state.ejections++, 20u);
+        unsigned delay = unsigned(std::min<unsigned long long>((unsigned long long)options_.eject_ms << shift,
+                                                               options_.max_eject_ms));
+        std::cerr << "Backend " << backend->address.host << ":" << backend->address.port
+                  << " ejected for " << delay << " ms" << std::endl;
+        state.timer.expires_from_now(std::chrono::milliseconds(delay));
+        state.timer.async_wait(boost::bind(&Health::readmit, shared_from_this(), backend,
+                                           boost::asio::placeholders::error));
+    }
+
+    void readmit(Backend* backend, const boost::system::error_code& error) {
+        if (error || stopped_)
+            return;
+        probe(backend, [this, backend](bool healthy) {
+            if (!healthy) {
+                hold(backend);
+                return;
+            }
+            states_[backend->index]->readmitted = clock::now();
+            backend->failures.store(0, std::memory_order_relaxed);
+            backend->ejected.store(false);
+            std::cerr << "Backend " << backend->address.host << ":" << backend->address.port
+                      << " readmitted" << std::endl;
+        });
+    }
+
+    void schedule_probes() {
+        timer_.expires_from_now(std::chrono::milliseconds(options_.interval_ms));
+        timer_.async_wait(boost::bind(&Health::probe_all, shared_from_this(), boost::asio::placeholders::error));
+    }
+
+    //Backends that are ejected are probed by readmit() instead.
+    void probe_all(const boost::system::error_code& error) {
+        if (error || stopped_)
+            return;
+        for (auto& backend : *backends_) {
+            Backend* target = backend.get();
+            if (ejected_or_probing(target))
+                continue;
+            probe(target, [this, target](bool healthy) {
+                if (healthy)
+                    target->failures.store(0, std::memory_order_relaxed);
+                else
+                    failed(target);
+            });
+        }
+        schedule_probes();
+    }
+
+    bool ejected_or_probing(Backend* backend) {
+        return backend->ejected.load(std::memory_order_relaxed) || states_[backend->index]->probing;
+    }
+
+    void probe(Backend* backend, std::function<void(bool)> done) {
+        State& state = *states_[backend->index];
+        state.probing = true;
+        std::shared_ptr<Health> self = shared_from_this();
+        std::shared_ptr<Probe> probe(new Probe(io_service_, [self, &state, done](bool healthy) {
+            state.probing = false;
+            if (!self->stopped_)
+                done(healthy);
+        }));
+        probe->socket.async_connect(backend->endpoint, [probe](const boost::system::error_code& error) {
+            finish(*probe, !error);
+        });
+        probe->timer.expires_from_now(std::chrono::milliseconds(options_.timeout_ms));
+        probe->timer.async_wait([probe](const boost::system::error_code& error) {
+            if (!error)
+                finish(*probe, false);
+        });
+    }
+
+    static void finish(Probe& probe, bool healthy) {
+        if (probe.finished)
+            return;
+        probe.finished = true;
+        boost::system::error_code ignored;
+        probe.socket.close(ignored);
+        probe.timer.cancel(ignored);
+        probe.done(healthy);
+    }
+
+    boost::asio::io_service& io_service_;
+    std::shared_ptr<std::vector<std::unique_ptr<Backend>>> backends_;
+    HealthOptions options_;
+    boost::asio::steady_timer timer_;   //active probes
+    std::vector<std::unique_ptr<State>> states_;
+    bool stopped_;
+};
+
+#endif //PROXY_HEALTH_H
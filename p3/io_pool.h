@@ -0,0 +1,52 @@
+#ifndef PROXY_IO_POOL_H
+#define PROXY_IO_POOL_H
+
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+//One io_service per thread. Each thread runs only its own service, so the
+//handlers of everything created on a service (a session and both of its
+//sockets) run on one thread and need neither locks nor strands. The
+//services are created with a concurrency hint of 1, which lets asio skip
+//its bookkeeping for handlers on several threads; posting to a service
+//from another thread is still safe.
+class IoPool {
+public:
+    explicit IoPool(size_t size) {
+        if (size == 0)
+            size = 1;
+        for (size_t i = 0; i < size; ++i) {
+            services_.emplace_back(new boost::asio::io_service(1));
+            work_.emplace_back(new boost::asio::io_service::work(*services_.back()));
+        }
+    }
+
+    size_t size() const { return services_.size(); }
+    boost::asio::io_service& get(size_t index) { return *services_[index]; }
+
+    //Runs service 0 on the calling thread and the others on new threads.
+    //Returns after stop().
+    void run() {
+        std::vector<std::thread> threads;
+        for (size_t i = 1; i < services_.size(); ++i)
+            threads.emplace_back([this, i]() { services_[i]->run(); });
+        services_[0]->run();
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    void stop() {
+        work_.clear();
+        for (auto& service : services_)
+            service->stop();
+    }
+
+private:
+    std::vector<std::unique_ptr<boost::asio::io_service>> services_;
+    std::vector<std::unique_ptr<boost::asio::io_service::work>> work_;
+};
+
+#endif //PROXY_IO_POOL_H
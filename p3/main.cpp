@@ -3,229 +3,347 @@
  Postnikov Mikhail.
  */
 
-#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
 #include <boost/bind.hpp>
 #include <boost/asio.hpp>
-#include <boost/thread/mutex.hpp>
-
-
+#include <boost/asio/steady_timer.hpp>
 
-
-//HOST:PORT Address structure
-struct Address {
-    unsigned short port;
-    std::string host;
-    Address(std::string hostport) {
-        std::size_t found = hostport.find(":");
-        if (found != std::string::npos) {
-            host = hostport.substr(0, found);
-            port = std::stoi(hostport.substr(found + 1));
-        }
-        else {
-            std::cerr << "Port wasn't found in " << hostport << "! Using port 80 instead." << std::endl;
-            host = hostport;
-            port = 80;
-        }
-    }
-};
+#include "admin.h"
+#include "config.h"
+#include "io_pool.h"
+#include "metrics.h"
+#include "route.h"
+#include "session.h"
+#include "warm_pool.h"
 
 
 
 
-using namespace boost::asio::ip;
+//SO_REUSEPORT, which asio has no option class for.
+typedef boost::asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT> reuse_port;
 
-//Client-Server Session
-class Session : public boost::enable_shared_from_this<Session> {
+//Acceptor of one port on one thread's io_service. Every thread listens on
+//the port itself, so the kernel spreads new connections over the threads.
+//
+//The socket is bound when the listener is made; start(), set_route() and
+//stop() run on the listener's own thread. A route change also replaces
+//the warm pools, which belong to the route's backends.
+class Listener : public std::enable_shared_from_this<Listener> {
 public:
-    Session(boost::asio::io_service& ios) : client_stream_socket_(ios), server_stream_socket_(ios) {}
-
-    tcp::socket& client_stream_socket() {
-        return client_stream_socket_;
-    }
-    
-    tcp::socket& server_stream_socket() {
-        return server_stream_socket_;
+    Listener(boost::asio::io_service& io_service, size_t thread, unsigned short local_port,
+             const SessionOptions& options, const PoolOptions& pool_options)
+    : io_service_(io_service), thread_(thread), acceptor_(io_service_), socket_(io_service_), pause_(io_service_),
+      options_(options), pool_options_(pool_options) {
+        tcp::endpoint endpoint(tcp::v4(), local_port);
+        acceptor_.open(endpoint.protocol());
+        acceptor_.set_option(tcp::acceptor::reuse_address(true));
+        acceptor_.set_option(reuse_port(true));
+        acceptor_.bind(endpoint);
+        acceptor_.listen();
     }
 
-    void start(const std::string& server_stream_host, unsigned short server_stream_port) {
-        server_stream_socket_.async_connect(
-                tcp::endpoint(
-                    boost::asio::ip::address::from_string(server_stream_host),
-                    server_stream_port),
-                boost::bind(&Session::handle_server_stream_connect,
-                    shared_from_this(),
-                    boost::asio::placeholders::error));
+    void start(const std::shared_ptr<Route>& route) {
+        set_route(route);
+        accept_connections();
     }
 
-private:
-    //Connect to server and initialize server/client async reads
-    void handle_server_stream_connect(const boost::system::error_code& error) {
-        if (!error) {
-            server_stream_socket_.async_read_some(
-                boost::asio::buffer(server_stream_data_, max_data_length),
-                boost::bind(&Session::handle_server_stream_read,
-                    shared_from_this(),
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
-            client_stream_socket_.async_read_some(
-                boost::asio::buffer(client_stream_data_, max_data_length),
-                boost::bind(&Session::handle_client_stream_read,
-                    shared_from_this(),
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
-        }
-        else close();
-    }
-    
-    //Read from server/client stream
-    void handle_server_stream_read(const boost::system::error_code& error, const size_t& bytes_transferred) {
-        if (!error) {
-            async_write(client_stream_socket_,
-                        boost::asio::buffer(server_stream_data_, bytes_transferred),
-                        boost::bind(&Session::handle_client_stream_write,
-                                    shared_from_this(),
-                                    boost::asio::placeholders::error));
+    void set_route(const std::shared_ptr<Route>& route) {
+        stop_pools();
+        route_ = route;
+        if (pool_options_.max > 0) {
+            for (auto& backend : *route_->backends) {
+                pools_.emplace_back(new WarmPool(io_service_, *backend, pool_options_));
+                pools_.back()->start();
+            }
         }
-        else close();
     }
 
-    void handle_client_stream_read(const boost::system::error_code& error, const size_t& bytes_transferred) {
-        if (!error) {
-            async_write(server_stream_socket_,
-                        boost::asio::buffer(client_stream_data_, bytes_transferred),
-                        boost::bind(&Session::handle_server_stream_write,
-                                    shared_from_this(),
-                                    boost::asio::placeholders::error));
-        }
-        else close();
+    void stop() {
+        boost::system::error_code ignored;
+        acceptor_.close(ignored);
+        pause_.cancel(ignored);
+        stop_pools();
     }
     
-    //Write to server/client stream
-    void handle_server_stream_write(const boost::system::error_code& error) {
-        if (!error) {
-            client_stream_socket_.async_read_some(
-                boost::asio::buffer(client_stream_data_, max_data_length),
-                boost::bind(&Session::handle_client_stream_read,
-                    shared_from_this(),
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
-        }
-        else close();
+private:
+    //Accept new connections; a session is made for each
+    void accept_connections() {
+        acceptor_.async_accept(socket_,
+                               boost::bind(&Listener::handle_accept,
+                                           shared_from_this(),
+                                           boost::asio::placeholders::error));
     }
     
-    void handle_client_stream_write(const boost::system::error_code& error) {
+    //Every error but the one stop() causes is counted and accepting goes
+    //on, after a pause when out of file descriptors.
+    void handle_accept(const boost::system::error_code& error) {
+        if (error == boost::asio::error::operation_aborted || !acceptor_.is_open())
+            return;
         if (!error) {
-            server_stream_socket_.async_read_some(
-                boost::asio::buffer(server_stream_data_, max_data_length),
-                boost::bind(&Session::handle_server_stream_read,
-                    shared_from_this(),
-                    boost::asio::placeholders::error,
-                    boost::asio::placeholders::bytes_transferred));
-        }
-        else close();
-    }
-    
-    //Close connections
-    void close() {
-        boost::mutex::scoped_lock lock(mutex_);
-        if (client_stream_socket_.is_open()) {
-            client_stream_socket_.close();
+            try {
+                boost::shared_ptr<Session> session(new Session(io_service_, route_, thread_, options_,
+                                                               pools_.empty() ? nullptr : &pools_));
+                session->client_stream_socket() = std::move(socket_);
+                socket_ = tcp::socket(io_service_);     //a moved-from socket has no executor
+                session->start();
+            }
+            catch(std::exception& e) {
+                std::cerr << "Acceptor exception: " << e.what() << std::endl;
+            }
         }
-        if (server_stream_socket_.is_open()) {
-            server_stream_socket_.close();
+        else {
+            route_->metrics->shard(thread_).accept_errors.add();
+            std::cerr << "Error: " << error.message() << std::endl;
+            if (out_of_descriptors(error)) {
+                pause_.expires_from_now(std::chrono::milliseconds(accept_pause_ms));
+                pause_.async_wait(boost::bind(&Listener::handle_pause,
+                                              shared_from_this(),
+                                              boost::asio::placeholders::error));
+                return;
+            }
         }
+        accept_connections();
     }
 
-    enum { max_data_length = 1024 };
-    tcp::socket client_stream_socket_;
-    tcp::socket server_stream_socket_;
-    unsigned char client_stream_data_[max_data_length];
-    unsigned char server_stream_data_[max_data_length];
-    boost::mutex mutex_;
+    void handle_pause(const boost::system::error_code& error) {
+        if (!error && acceptor_.is_open())
+            accept_connections();
+    }
+
+    void stop_pools() {
+        for (auto& pool : pools_)
+            pool->stop();
+        pools_.clear();
+    }
+    
+    boost::asio::io_service& io_service_;
+    size_t thread_;
+    tcp::acceptor acceptor_;
+    tcp::socket socket_;
+    boost::asio::steady_timer pause_;   //after running out of file descriptors
+    std::shared_ptr<Route> route_;
+    const SessionOptions& options_;
+    const PoolOptions& pool_options_;
+    WarmPools pools_;
 };
 
 
 
 
-//Proxy server to create client-server sessions
+//Proxy server to create client-server sessions: for every port of the
+//settings a route and one listener per thread.
+//
+//The settings are read again on SIGHUP and when the file changes (checked
+//every second), on the first thread. A reload applies completely or not
+//at all: new routes and new listeners are all made first, and only then
+//does every thread switch over, each through its own io_service. Sessions
+//already running keep their old route; a port whose settings did not
+//change keeps its route, health state and metrics.
 class ProxyServer {
 public:
-    ProxyServer(boost::asio::io_service& io_service, unsigned short local_port, std::vector<Address> &destinations)
-    : io_service_(io_service), acceptor_(io_service_, tcp::endpoint(tcp::v4(), local_port)), destinations_(destinations) {
-        accept_connections();
+    //Throws if the settings can't be used.
+    ProxyServer(IoPool& pool, const std::string& path, const SessionOptions& options,
+                const PoolOptions& pool_options)
+    : pool_(pool), path_(path), options_(options), pool_options_(pool_options),
+      signals_(pool.get(0), SIGHUP), timer_(pool.get(0)) {
+        modified_ = modified();
+        apply(Config::load(path_));
+        wait_for_signal();
+        schedule_check();
+    }
+
+    //Of the current routes; on the first thread.
+    std::vector<const Metrics*> metrics() const {
+        std::vector<const Metrics*> metrics;
+        for (auto& port : ports_)
+            metrics.push_back(port.second.route->metrics.get());
+        return metrics;
     }
     
 private:
-    //Accept new connections and create new bridge
-    void accept_connections() {
-        try {
-            session_ = boost::shared_ptr<Session>(new Session(io_service_));
-            acceptor_.async_accept(session_->client_stream_socket(),
-                                   boost::bind(&ProxyServer::handle_accept,
-                                               this,
-                                               boost::asio::placeholders::error));
+    struct Port {
+        std::shared_ptr<Route> route;
+        std::vector<std::shared_ptr<Listener>> listeners;
+    };
+
+    void apply(const std::vector<PortConfig>& configs) {
+        std::map<unsigned short, Port> ports;
+        for (auto& config : configs) {
+            auto found = ports_.find(config.port);
+            Port& port = ports[config.port];
+            if (found != ports_.end()) {
+                port.listeners = found->second.listeners;
+                port.route = found->second.route;
+                if (port.route->config.text == config.text)
+                    continue;
+            }
+            port.route.reset(new Route(config, pool_.get(0), pool_.size()));
+            if (port.listeners.empty()) {
+                for (size_t i = 0; i < pool_.size(); ++i)
+                    port.listeners.emplace_back(new Listener(pool_.get(i), i, config.port, options_, pool_options_));
+            }
+        }
+
+        //Everything is made; switch over
+        for (auto& entry : ports) {
+            Port& port = entry.second;
+            auto found = ports_.find(entry.first);
+            bool listening = found != ports_.end();
+            if (listening && found->second.route == port.route)
+                continue;
+            std::cout << (listening ? "Reloaded port " : "Listening on port ") << entry.first << ": "
+                      << port.route->backends->size() << " backends, " << port.route->config.policy
+                      << " balancing" << std::endl;
+            for (size_t i = 0; i < pool_.size(); ++i) {
+                std::shared_ptr<Listener> listener = port.listeners[i];
+                std::shared_ptr<Route> route = port.route;
+                if (listening)
+                    pool_.get(i).post([listener, route]() { listener->set_route(route); });
+                else
+                    pool_.get(i).post([listener, route]() { listener->start(route); });
+            }
         }
-        catch(std::exception& e) {
-            std::cerr << "Acceptor exception: " << e.what() << std::endl;
+        for (auto& entry : ports_) {
+            if (ports.count(entry.first))
+                continue;
+            std::cout << "Closed port " << entry.first << std::endl;
+            for (size_t i = 0; i < pool_.size(); ++i) {
+                std::shared_ptr<Listener> listener = entry.second.listeners[i];
+                pool_.get(i).post([listener]() { listener->stop(); });
+            }
         }
+        ports_.swap(ports);
     }
-    
-    void handle_accept(const boost::system::error_code& error) {
-        if (!error) {
-            Address address = destinations_[rand() % destinations_.size()];
-            std::string server_stream_host_ = address.host;
-            unsigned short server_stream_port_ = address.port;
-            session_->start(server_stream_host_, server_stream_port_);
-            accept_connections();
+
+    void reload() {
+        modified_ = modified();
+        try {
+            apply(Config::load(path_));
         }
-        else {
-            std::cerr << "Error: " << error.message() << std::endl;
+        catch (std::exception& e) {
+            std::cerr << "Reload of " << path_ << " failed, keeping the old settings: " << e.what() << std::endl;
         }
     }
-    
-    boost::asio::io_service& io_service_;
-    tcp::acceptor acceptor_;
-    boost::shared_ptr<Session> session_;
-    std::vector<Address> destinations_;
+
+    void wait_for_signal() {
+        signals_.async_wait([this](const boost::system::error_code& error, int) {
+            if (error)
+                return;
+            reload();
+            wait_for_signal();
+        });
+    }
+
+    void schedule_check() {
+        timer_.expires_from_now(std::chrono::seconds(1));
+        timer_.async_wait([this](const boost::system::error_code& error) {
+            if (error)
+                return;
+            struct timespec now = modified();
+            if (now.tv_sec != modified_.tv_sec || now.tv_nsec != modified_.tv_nsec)
+                reload();
+            schedule_check();
+        });
+    }
+
+    struct timespec modified() const {
+        struct stat info;
+        struct timespec none = { 0, 0 };
+        if (stat(path_.c_str(), &info) != 0)
+            return none;
+#ifdef __APPLE__
+        return info.st_mtimespec;
+#else
+        return info.st_mtim;
+#endif
+    }
+
+    IoPool& pool_;
+    std::string path_;
+    const SessionOptions& options_;
+    const PoolOptions& pool_options_;
+    boost::asio::signal_set signals_;
+    boost::asio::steady_timer timer_;
+    struct timespec modified_;
+    std::map<unsigned short, Port> ports_;
 };
 
 
+//Ring sizes are powers of two.
+size_t round_up(int size) {
+    size_t rounded = 1024;
+    while (rounded < size_t(std::max(size, 0)))
+        rounded *= 2;
+    return rounded;
+}
+
+//-p MIN[:MAX]: warm connections per backend and thread; MAX defaults to MIN.
+void parse_pool(const std::string& text, PoolOptions& pool_options) {
+    std::size_t colon = text.find(':');
+    pool_options.min = std::max(0, atoi(text.c_str()));
+    pool_options.max = colon == std::string::npos ? pool_options.min : std::max(0, atoi(text.c_str() + colon + 1));
+    pool_options.max = std::max(pool_options.max, pool_options.min);
+}
+
 int main(int argc, char* argv[]) {
     try {
-        if (argc != 2) {
-            std::cerr << "Usage: proxy <settings_file>" << std::endl;
-            return 1;
+        //Threads, one io_service each; all cores by default
+        size_t threads = std::thread::hardware_concurrency();
+        SessionOptions options;
+        PoolOptions pool_options;
+        unsigned short admin_port = 0;
+        int dump_seconds = 0;
+        int option;
+        while ((option = getopt(argc, argv, "t:b:r:zp:i:m:s:")) != -1) {
+            switch (option) {
+                case 't': threads = atoi(optarg); break;
+                case 'b': options.buffer_size = round_up(atoi(optarg)); break;
+                case 'r': options.read_size = std::max(1, atoi(optarg)); break;
+                case 'z': options.splice = true; break;
+                case 'p': parse_pool(optarg, pool_options); break;
+                case 'i': pool_options.idle_ms = atoi(optarg); break;
+                case 'm': admin_port = atoi(optarg); break;
+                case 's': dump_seconds = atoi(optarg); break;
+                default: optind = argc + 1; break;
+            }
         }
-        
-        //Open settings file
-        std::ifstream settings(argv[1]);
-        if (!settings.is_open()) {
-            std::cout << "File couldn't be opened!" << std::endl;
+        if (optind != argc - 1) {
+            std::cerr << "Usage: proxy [-t threads] [-b buffer_bytes] [-r read_bytes] [-z]" << std::endl
+                      << "             [-p pool_min[:pool_max]] [-i pool_idle_ms] [-m admin_port] [-s dump_seconds]"
+                      << std::endl << "             <settings_file>" << std::endl;
             return 1;
         }
         
-        //Scan port
-        unsigned short port;
-        settings >> port;
-        
-        //Scan destination servers
-        std::string hostport;
-        std::vector<Address> destinations;
-        while (settings >> hostport)
-            destinations.push_back(Address(hostport));
-        settings.close();
-        
-        //Create accessor
-        std::cout << "Starting proxy server at port " << port << std::endl;
-        boost::asio::io_service io_service;
-        ProxyServer server(io_service, port, destinations);
-        io_service.run();
+        //Read the settings and start listening
+        IoPool pool(threads);
+        std::cout << "Starting proxy server with " << pool.size() << " threads"
+                  << (options.splice ? ", splice" : "") << std::endl;
+        ProxyServer server(pool, argv[optind], options, pool_options);
+
+        //Metrics on the admin port and/or to stderr, from the first thread
+        MetricsSource metrics = [&server]() { return server.metrics(); };
+        std::unique_ptr<AdminServer> admin;
+        if (admin_port)
+            admin.reset(new AdminServer(pool.get(0), admin_port, metrics));
+        std::unique_ptr<MetricsDump> dump;
+        if (dump_seconds > 0)
+            dump.reset(new MetricsDump(pool.get(0), dump_seconds, metrics));
+        pool.run();
     }
     catch (std::exception& e) {
         std::cerr << "Exception: " << e.what() << "\n";
@@ -0,0 +1,173 @@
+#ifndef PROXY_METRICS_H
+#define PROXY_METRICS_H
+
+#include <stdint.h>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "balancer.h"
+
+//Counter with a single writer, the thread that owns its shard. The update
+//is a plain load and store, with no locked instruction; readers on other
+//threads see some recent value.
+class Counter {
+public:
+    Counter() : value_(0) {}
+
+    void add(uint64_t n = 1) { value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> value_;
+};
+
+//Connect latency in power-of-two buckets of microseconds: bucket i holds
+//times below 2^i us, the last one everything slower.
+class Histogram {
+public:
+    enum { buckets = 24 };
+
+    void add(std::chrono::steady_clock::duration elapsed) {
+        uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        size_t bucket = 0;
+        while (bucket < buckets - 1 && us >= (uint64_t(1) << bucket))
+            ++bucket;
+        counts_[bucket].add();
+    }
+
+    uint64_t count(size_t bucket) const { return counts_[bucket].get(); }
+
+private:
+    Counter counts_[buckets];
+};
+
+//Numbers of one backend, as one thread sees them.
+struct BackendStats {
+    Counter sessions;           //forwarding started
+    Counter closed;
+    Counter pooled;             //sessions that took a warm connection
+    Counter bytes_in;           //client -> backend
+    Counter bytes_out;          //backend -> client
+    Counter connect_failures;
+    Counter connect_timeouts;
+    Counter io_errors;
+    Histogram connect_latency;
+    char padding[64];           //off the next allocation's cache line
+};
+
+//Numbers of one listen port, as one thread sees them. Each shard and its
+//backends are allocations of their own, padded so that two threads never
+//write to one cache line.
+struct PortStats {
+    explicit PortStats(size_t backends) : backends(backends) {}
+
+    Counter sessions;           //accepted
+    Counter closed;
+    Counter unserved;           //closed with no backend reached
+    Counter accept_errors;
+    std::vector<BackendStats> backends;
+    char padding[64];
+};
+
+//Metrics of a port, sharded per thread: a session only updates the shard
+//of its own thread, and report() adds the shards up.
+class Metrics {
+public:
+    Metrics(unsigned short port, std::vector<std::unique_ptr<Backend>>& backends, size_t threads)
+    : port_(port), backends_(backends) {
+        for (size_t i = 0; i < threads; ++i)
+            shards_.emplace_back(new PortStats(backends.size()));
+    }
+
+    PortStats& shard(size_t thread) { return *shards_[thread]; }
+
+    //One line for the port, then a line per backend with the connect
+    //latency percentiles and the non-empty histogram buckets.
+    void report(std::ostream& out) const {
+        uint64_t sessions = 0, closed = 0, unserved = 0, accept_errors = 0;
+        for (auto& shard : shards_) {
+            sessions += shard->sessions.get();
+            closed += shard->closed.get();
+            unserved += shard->unserved.get();
+            accept_errors += shard->accept_errors.get();
+        }
+        uint64_t bytes_in = 0, bytes_out = 0;
+        for (size_t i = 0; i < backends_.size(); ++i) {
+            bytes_in += sum(i, &BackendStats::bytes_in);
+            bytes_out += sum(i, &BackendStats::bytes_out);
+        }
+        out << "port " << port_ << " sessions " << sessions << " active " << active(sessions, closed)
+            << " bytes_in " << bytes_in << " bytes_out " << bytes_out
+            << " unserved " << unserved << " accept_errors " << accept_errors << "\n";
+        for (size_t i = 0; i < backends_.size(); ++i)
+            report_backend(out, i);
+    }
+
+private:
+    static uint64_t active(uint64_t sessions, uint64_t closed) {
+        return sessions > closed ? sessions - closed : 0;
+    }
+
+    uint64_t sum(size_t backend, Counter BackendStats::*counter) const {
+        uint64_t total = 0;
+        for (auto& shard : shards_)
+            total += (shard->backends[backend].*counter).get();
+        return total;
+    }
+
+    void report_backend(std::ostream& out, size_t i) const {
+        const Backend& backend = *backends_[i];
+        uint64_t sessions = sum(i, &BackendStats::sessions);
+        out << "  backend " << backend.address.host << ":" << backend.address.port
+            << (backend.ejected.load(std::memory_order_relaxed) ? " ejected" : "")
+            << " sessions " << sessions << " active " << active(sessions, sum(i, &BackendStats::closed))
+            << " pooled " << sum(i, &BackendStats::pooled)
+            << " bytes_in " << sum(i, &BackendStats::bytes_in) << " bytes_out " << sum(i, &BackendStats::bytes_out)
+            << " connect_failures " << sum(i, &BackendStats::connect_failures)
+            << " connect_timeouts " << sum(i, &BackendStats::connect_timeouts)
+            << " io_errors " << sum(i, &BackendStats::io_errors) << "\n";
+
+        uint64_t counts[Histogram::buckets], total = 0;
+        for (size_t bucket = 0; bucket < Histogram::buckets; ++bucket) {
+            counts[bucket] = 0;
+            for (auto& shard : shards_)
+                counts[bucket] += shard->backends[i].connect_latency.count(bucket);
+            total += counts[bucket];
+        }
+        out << "    connect_us";
+        if (total > 0) {
+            out << " p50<" << percentile(counts, total, 0.5) << " p90<" << percentile(counts, total, 0.9)
+                << " p99<" << percentile(counts, total, 0.99);
+            for (size_t bucket = 0; bucket < Histogram::buckets; ++bucket) {
+                if (counts[bucket] > 0)
+                    out << " " << bound(bucket) << ":" << counts[bucket];
+            }
+        }
+        out << "\n";
+    }
+
+    //Upper bound of the bucket that holds the given fraction of the total.
+    static std::string percentile(const uint64_t* counts, uint64_t total, double fraction) {
+        uint64_t seen = 0;
+        for (size_t bucket = 0; bucket < Histogram::buckets; ++bucket) {
+            seen += counts[bucket];
+            if (seen >= total * fraction)
+                return bound(bucket);
+        }
+        return bound(Histogram::buckets - 1);
+    }
+
+    static std::string bound(size_t bucket) {
+        return bucket == Histogram::buckets - 1 ? "inf" : std::to_string(uint64_t(1) << bucket);
+    }
+
+    unsigned short port_;
+    std::vector<std::unique_ptr<Backend>>& backends_;
+    std::vector<std::unique_ptr<PortStats>> shards_;
+};
+
+#endif //PROXY_METRICS_H
@@ -0,0 +1,323 @@
+/*
+ Throughput and latency of the proxy against the backends reached directly.
+
+   proxy_bench [-k BACKENDS] [-c CLIENTS] [-d SECONDS] [-l LENGTH] [-x PROXY] [-- PROXY OPTIONS]
+
+ Starts K echo and K sink backends on threads of its own, writes a config
+ with one proxy port over the echo backends and one over the sinks, and
+ runs PROXY (./proxy_server) on it. Then, once straight to the backends
+ (clients spread over them round-robin) and once through the proxy:
+
+   rr    each of the M clients sends LENGTH bytes and waits for the echo;
+         requests/s and round-trip percentiles
+   bulk  each client streams 64 KB writes into a sink; Gbit/s as the
+         sinks count it
+
+ The difference between the two rows of a mode is what the proxy costs.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+typedef std::chrono::steady_clock Clock;
+
+static std::atomic<uint64_t> sunk(0);      //bytes all sinks have read
+
+static sockaddr_in loopback(unsigned short port) {
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    return address;
+}
+
+static void no_delay(int fd) {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+}
+
+//Listening socket on a port the kernel picks.
+static int listen_any(unsigned short& port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = loopback(0);
+    socklen_t length = sizeof(address);
+    if (bind(fd, (sockaddr*)&address, length) == -1 || listen(fd, 1024) == -1
+        || getsockname(fd, (sockaddr*)&address, &length) == -1) {
+        perror("listen");
+        exit(1);
+    }
+    port = ntohs(address.sin_port);
+    return fd;
+}
+
+//A port that was free a moment ago, for the proxy to listen on.
+static unsigned short free_port() {
+    unsigned short port;
+    close(listen_any(port));
+    return port;
+}
+
+//-1 if nobody listens.
+static int connect_to(unsigned short port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = loopback(port);
+    if (connect(fd, (sockaddr*)&address, sizeof(address)) == -1) {
+        close(fd);
+        return -1;
+    }
+    no_delay(fd);
+    return fd;
+}
+
+static bool send_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t sent = write(fd, data, length);
+        if (sent <= 0)
+            return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+static bool receive_all(int fd, char* data, size_t length) {
+    while (length > 0) {
+        ssize_t received = read(fd, data, length);
+        if (received <= 0)
+            return false;
+        data += received;
+        length -= received;
+    }
+    return true;
+}
+
+//Backend with a thread per connection: echoes, or reads and counts.
+static void serve(int listener, bool echo) {
+    for (;;) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd == -1)
+            return;
+        no_delay(fd);
+        std::thread([fd, echo]() {
+            std::vector<char> data(65536);
+            ssize_t received;
+            while ((received = read(fd, data.data(), data.size())) > 0) {
+                if (!echo)
+                    sunk += received;
+                else if (!send_all(fd, data.data(), received))
+                    break;
+            }
+            close(fd);
+        }).detach();
+    }
+}
+
+struct Result {
+    double seconds = 0;
+    uint64_t requests = 0, bytes = 0;
+    std::vector<uint32_t> latencies_us;     //sorted
+    size_t failed = 0;
+};
+
+//Runs `clients` clients for `seconds`; client i connects to ports[i % size].
+static Result run(bool rr, const std::vector<unsigned short>& ports, size_t clients, double seconds, size_t length) {
+    std::atomic<size_t> ready(0), failed(0);
+    std::atomic<bool> go(false), stop(false);
+    std::vector<std::vector<uint32_t>> latencies(clients);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < clients; ++i) {
+        threads.emplace_back([&, i]() {
+            int fd = connect_to(ports[i % ports.size()]);
+            std::vector<char> request(rr ? length : 65536, 'x'), reply(request.size());
+            ++ready;
+            while (!go)
+                std::this_thread::yield();
+            bool ok = fd != -1;
+            while (ok && !stop) {
+                if (!rr) {
+                    ok = send_all(fd, request.data(), request.size());
+                    continue;
+                }
+                Clock::time_point sent = Clock::now();
+                ok = send_all(fd, request.data(), length) && receive_all(fd, reply.data(), length);
+                if (ok && !stop)
+                    latencies[i].push_back(uint32_t(std::chrono::duration_cast<std::chrono::microseconds>(
+                            Clock::now() - sent).count()));
+            }
+            if (!ok)
+                ++failed;
+            if (fd != -1)
+                close(fd);
+        });
+    }
+    while (ready < clients)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    Result result;
+    uint64_t sunk_before = sunk;
+    Clock::time_point started = Clock::now();
+    go = true;
+    std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+    stop = true;
+    result.seconds = std::chrono::duration<double>(Clock::now() - started).count();
+    uint64_t sunk_after = sunk;
+    for (auto& thread : threads)
+        thread.join();
+
+    for (auto& client : latencies)
+        result.latencies_us.insert(result.latencies_us.end(), client.begin(), client.end());
+    std::sort(result.latencies_us.begin(), result.latencies_us.end());
+    result.requests = result.latencies_us.size();
+    result.bytes = rr ? 2 * result.requests * length : sunk_after - sunk_before;
+    //Streaming clients are stopped mid-write; only rr counts failures.
+    result.failed = rr ? size_t(failed) : 0;
+    return result;
+}
+
+static uint32_t percentile(const std::vector<uint32_t>& sorted, double fraction) {
+    if (sorted.empty())
+        return 0;
+    return sorted[std::min(sorted.size() - 1, size_t(sorted.size() * fraction))];
+}
+
+static void report(const char* mode, const char* target, const Result& result) {
+    std::cout << std::left << std::setw(6) << mode << std::setw(8) << target << std::right << std::fixed
+              << std::setw(12) << std::setprecision(0) << result.requests / result.seconds
+              << std::setw(10) << std::setprecision(2) << result.bytes * 8 / result.seconds / 1e9;
+    if (!result.latencies_us.empty()) {
+        for (double fraction : { 0.5, 0.9, 0.99, 0.999 })
+            std::cout << std::setw(9) << percentile(result.latencies_us, fraction);
+    }
+    if (result.failed > 0)
+        std::cout << "  (" << result.failed << " clients failed)";
+    std::cout << std::endl;
+}
+
+static void usage() {
+    std::cerr << "Usage: proxy_bench [-k BACKENDS] [-c CLIENTS] [-d SECONDS] [-l LENGTH] [-x PROXY]"
+                 " [-- PROXY OPTIONS]" << std::endl;
+    exit(1);
+}
+
+int main(int argc, char* argv[]) {
+    size_t backends = 2, clients = 8, length = 64;
+    double seconds = 3;
+    std::string proxy = "./proxy_server";
+    int option;
+    while ((option = getopt(argc, argv, "k:c:d:l:x:")) != -1) {
+        switch (option) {
+            case 'k': backends = std::max(1, atoi(optarg)); break;
+            case 'c': clients = std::max(1, atoi(optarg)); break;
+            case 'd': seconds = std::max(0.1, atof(optarg)); break;
+            case 'l': length = std::max(1, atoi(optarg)); break;
+            case 'x': proxy = optarg; break;
+            default: usage();
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    std::vector<unsigned short> echo_ports, sink_ports;
+    for (size_t i = 0; i < 2 * backends; ++i) {
+        unsigned short port;
+        int listener = listen_any(port);
+        bool echo = i < backends;
+        (echo ? echo_ports : sink_ports).push_back(port);
+        std::thread(serve, listener, echo).detach();
+    }
+
+    unsigned short echo_proxy = free_port(), sink_proxy = free_port();
+    std::string config = "/tmp/proxy_bench." + std::to_string(getpid());
+    {
+        std::ofstream file(config.c_str());
+        file << echo_proxy;
+        for (unsigned short port : echo_ports)
+            file << ",127.0.0.1:" << port;
+        file << ",policy=round_robin\n" << sink_proxy;
+        for (unsigned short port : sink_ports)
+            file << ",127.0.0.1:" << port;
+        file << ",policy=round_robin\n";
+    }
+
+    std::vector<char*> proxy_argv;
+    proxy_argv.push_back(const_cast<char*>(proxy.c_str()));
+    for (int i = optind; i < argc; ++i)
+        proxy_argv.push_back(argv[i]);
+    proxy_argv.push_back(const_cast<char*>(config.c_str()));
+    proxy_argv.push_back(nullptr);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, 1);
+        dup2(null, 2);
+        execv(proxy_argv[0], proxy_argv.data());
+        _exit(127);
+    }
+
+    bool up = false, exited = false;
+    for (int i = 0; i < 300 && !up && !exited; ++i) {
+        exited = waitpid(pid, nullptr, WNOHANG) == pid;
+        int echo_fd = connect_to(echo_proxy), sink_fd = connect_to(sink_proxy);
+        up = echo_fd != -1 && sink_fd != -1;
+        if (echo_fd != -1)
+            close(echo_fd);
+        if (sink_fd != -1)
+            close(sink_fd);
+        if (!up)
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    if (!up) {
+        std::cerr << "Proxy " << proxy << (exited ? " exited" : " did not come up") << std::endl;
+        if (!exited) {
+            kill(pid, SIGTERM);
+            waitpid(pid, nullptr, 0);
+        }
+        unlink(config.c_str());
+        return 1;
+    }
+
+    std::cout << backends << " echo and " << backends << " sink backends, " << clients << " clients, "
+              << length << " byte requests, " << seconds << " s per run\n"
+              << "mode  target   requests/s    Gbit/s   p50_us   p90_us   p99_us  p999_us" << std::endl;
+    Result rr_direct = run(true, echo_ports, clients, seconds, length);
+    report("rr", "direct", rr_direct);
+    Result rr_proxy = run(true, { echo_proxy }, clients, seconds, length);
+    report("rr", "proxy", rr_proxy);
+    Result bulk_direct = run(false, sink_ports, clients, seconds, length);
+    report("bulk", "direct", bulk_direct);
+    Result bulk_proxy = run(false, { sink_proxy }, clients, seconds, length);
+    report("bulk", "proxy", bulk_proxy);
+
+    std::cout << std::setprecision(1)
+              << "proxy overhead: rr p50 +" << int(percentile(rr_proxy.latencies_us, 0.5))
+                                              - int(percentile(rr_direct.latencies_us, 0.5)) << " us, "
+              << 100 * (1 - (rr_proxy.requests / rr_proxy.seconds) / (rr_direct.requests / rr_direct.seconds))
+              << "% fewer requests/s; bulk "
+              << 100 * (1 - (bulk_proxy.bytes / bulk_proxy.seconds) / (bulk_direct.bytes / bulk_direct.seconds))
+              << "% less throughput" << std::endl;
+
+    kill(pid, SIGTERM);
+    waitpid(pid, nullptr, 0);
+    unlink(config.c_str());
+    return 0;
+}
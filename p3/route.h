@@ -0,0 +1,54 @@
+#ifndef PROXY_ROUTE_H
+#define PROXY_ROUTE_H
+
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include "balancer.h"
+#include "config.h"
+#include "health.h"
+#include "metrics.h"
+
+//One generation of a listen port: its backends with the balancer, health
+//checks and metrics over them. Listeners and sessions share it; a reload
+//that changes the port makes a new one, and the old one goes away with
+//its last session.
+//
+//Created on the first thread, which also runs the health checks; the
+//destructor may run on any thread and only posts the stop there. The
+//health checks share the backends, so those outlive the route until the
+//last of their handlers is done.
+class Route {
+public:
+    //Throws std::runtime_error for an unknown policy or a bad address.
+    Route(const PortConfig& config, boost::asio::io_service& io_service, size_t threads)
+    : config(config), backends(std::make_shared<std::vector<std::unique_ptr<Backend>>>()), io_service_(io_service) {
+        for (auto& destination : config.destinations)
+            backends->emplace_back(new Backend(destination.address, destination.weight, backends->size()));
+        balancer.reset(Balancer::create(config.policy, *backends));
+        if (!balancer)
+            throw std::runtime_error("unknown balancing policy " + config.policy);
+        health.reset(new Health(io_service, backends, config.health));
+        health->start();
+        metrics.reset(new Metrics(config.port, *backends, threads));
+    }
+
+    ~Route() {
+        std::shared_ptr<Health> checks = health;
+        io_service_.post([checks]() { checks->stop(); });
+    }
+
+    const PortConfig config;
+    std::shared_ptr<std::vector<std::unique_ptr<Backend>>> backends;
+    std::unique_ptr<Balancer> balancer;
+    std::shared_ptr<Health> health;
+    std::unique_ptr<Metrics> metrics;
+
+private:
+    boost::asio::io_service& io_service_;
+};
+
+#endif //PROXY_ROUTE_H
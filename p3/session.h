@@ -0,0 +1,453 @@
+#ifndef PROXY_SESSION_H
+#define PROXY_SESSION_H
+
+#include <array>
+#include <memory>
+
+#ifdef __linux__
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include <boost/shared_ptr.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "config.h"
+#include "handler_memory.h"
+#include "route.h"
+#include "warm_pool.h"
+
+using namespace boost::asio::ip;
+
+//Per-direction buffering of a session.
+struct SessionOptions {
+    size_t buffer_size = 64 * 1024;     //ring per direction, a power of two
+    size_t read_size = 32 * 1024;       //most a single read asks for
+    bool splice = false;                //zero-copy through a pipe (Linux)
+};
+
+//Byte ring with free-running indices. Pending data and free space are
+//each handed to asio as (at most) two buffers.
+class ByteRing {
+public:
+    explicit ByteRing(size_t capacity) : data_(new char[capacity]), capacity_(capacity), head_(0), tail_(0) {}
+
+    size_t size() const { return tail_ - head_; }
+    size_t room() const { return capacity_ - size(); }
+    bool empty() const { return head_ == tail_; }
+
+    std::array<boost::asio::mutable_buffer, 2> space(size_t limit) {
+        size_t length = std::min(room(), limit);
+        size_t start = tail_ & (capacity_ - 1);
+        size_t first = std::min(length, capacity_ - start);
+        return {{ boost::asio::buffer(data_.get() + start, first), boost::asio::buffer(data_.get(), length - first) }};
+    }
+
+    std::array<boost::asio::const_buffer, 2> data() const {
+        size_t start = head_ & (capacity_ - 1);
+        size_t first = std::min(size(), capacity_ - start);
+        return {{ boost::asio::buffer(data_.get() + start, first), boost::asio::buffer(data_.get(), size() - first) }};
+    }
+
+    void commit(size_t length) { tail_ += length; }
+    void consume(size_t length) { head_ += length; }
+
+private:
+    std::unique_ptr<char[]> data_;
+    size_t capacity_;
+    size_t head_, tail_;
+};
+
+//Client-Server Session. All of its handlers run on the thread of the
+//io_service it was created on. It keeps the route it started with, also
+//across a reload.
+//
+//Each direction has its own ring. A read is issued whenever the ring has
+//room and a write whenever it has data, so reading the next chunk from one
+//socket overlaps writing the previous one to the other.
+//
+//The directions end on their own. End-of-file from one side is passed on
+//with shutdown(SHUT_WR) to the other once everything read before it has
+//gone out, and the opposite direction keeps flowing; the session closes
+//both sockets when both directions have ended, or at once on an error.
+//
+//With options.splice (Linux only) the bytes never enter user space: each
+//direction moves them socket -> pipe -> socket with splice(), and asio is
+//used only to wait for the sockets to become readable or writable. A
+//direction falls back to its ring when a pipe can't be made or the
+//sockets don't support splice.
+//
+//A connect that fails or runs out of its time is retried on another
+//backend, while attempts and the overall budget last.
+//
+//Each kind of operation has at most one outstanding at a time, and its
+//handler takes the operation's memory from a block of the session's own
+//(handler_memory.h), so forwarding does no heap allocation once started.
+class Session : public boost::enable_shared_from_this<Session> {
+public:
+    Session(boost::asio::io_service& ios, const std::shared_ptr<Route>& route, size_t thread,
+            const SessionOptions& options, WarmPools* pools)
+    : route_(route), client_stream_socket_(ios), server_stream_socket_(ios), balancer_(*route->balancer),
+      health_(*route->health), backend_(nullptr), connect_options_(route->config.connect), connect_timer_(ios),
+      attempts_(0), options_(options), pools_(pools), stats_(route->metrics->shard(thread)),
+      connecting_(false), started_(false), forwarding_(false), to_server_(client_stream_socket_, server_stream_socket_, options.buffer_size),
+      to_client_(server_stream_socket_, client_stream_socket_, options.buffer_size) {}
+
+    ~Session() {
+        if (started_) {
+            stats_.closed.add();
+            if (forwarding_)
+                backend_stats().closed.add();
+            else
+                stats_.unserved.add();
+        }
+        if (backend_)
+            balancer_.release(backend_);
+    }
+
+    tcp::socket& client_stream_socket() {
+        return client_stream_socket_;
+    }
+
+    tcp::socket& server_stream_socket() {
+        return server_stream_socket_;
+    }
+
+    //Connect to the backend the balancer picked for this client, or take
+    //a connection to it from the warm pool
+    void start() {
+        started_ = true;
+        stats_.sessions.add();
+        boost::system::error_code error;
+        backend_ = balancer_.pick(client_stream_socket_.remote_endpoint(error));
+        if (pools_ && (*pools_)[backend_->index]->take(server_stream_socket_)) {
+            backend_stats().pooled.add();
+            forward();
+            return;
+        }
+        deadline_ = Health::clock::now() + std::chrono::milliseconds(connect_options_.budget_ms);
+        connect();
+    }
+
+private:
+    //One direction: bytes read from `from` wait in `ring` (or in the pipe
+    //`piped` bytes long) to go to `to`.
+    struct Direction {
+        Direction(tcp::socket& from, tcp::socket& to, size_t buffer_size)
+        : from(from), to(to), ring(buffer_size), reading(false), writing(false), eof(false), done(false),
+          pipe{-1, -1}, pipe_size(0), piped(0) {}
+
+        ~Direction() {
+            if (pipe[0] != -1) {
+                ::close(pipe[0]);
+                ::close(pipe[1]);
+            }
+        }
+
+        tcp::socket& from;
+        tcp::socket& to;
+        ByteRing ring;
+        HandlerMemory read_memory, write_memory;
+        bool reading, writing, eof;
+        bool done;                  //end-of-file passed on
+        int pipe[2];
+        size_t pipe_size, piped;
+    };
+
+    void connect() {
+        unsigned attempt = ++attempts_;
+        connecting_ = true;
+        connect_started_ = Health::clock::now();
+        boost::shared_ptr<Session> self = shared_from_this();
+        if (connect_options_.timeout_ms > 0) {
+            Health::clock::time_point expiry = connect_started_ + std::chrono::milliseconds(connect_options_.timeout_ms);
+            connect_timer_.expires_at(std::min(expiry, deadline_));
+            connect_timer_.async_wait(make_alloc_handler(timer_memory_,
+                    [this, self, attempt](const boost::system::error_code& error) {
+                        handle_connect_timeout(attempt, error);
+                    }));
+        }
+        server_stream_socket_.async_connect(backend_->endpoint, make_alloc_handler(connect_memory_,
+                [this, self](const boost::system::error_code& error) { handle_server_stream_connect(error); }));
+    }
+
+    //Closing the socket ends the connect with operation_aborted. An expiry
+    //that was already queued when its connect finished, or that belongs to
+    //an earlier attempt, is ignored; cancel() can't take it back.
+    void handle_connect_timeout(unsigned attempt, const boost::system::error_code& error) {
+        if (!error && connecting_ && attempt == attempts_) {
+            boost::system::error_code ignored;
+            server_stream_socket_.close(ignored);
+        }
+    }
+
+    //Connect to server and initialize server/client async reads; on
+    //failure try another backend
+    void handle_server_stream_connect(const boost::system::error_code& error) {
+        connecting_ = false;
+        connect_timer_.cancel();
+        //The timeout may have closed the socket just as the connect went
+        //through.
+        bool connected = !error && server_stream_socket_.is_open();
+        Health::clock::duration elapsed = Health::clock::now() - connect_started_;
+        health_.report(backend_, connected, elapsed);
+        if (connected)
+            backend_stats().connect_latency.add(elapsed);
+        else if (!error || error == boost::asio::error::operation_aborted)
+            backend_stats().connect_timeouts.add();
+        else
+            backend_stats().connect_failures.add();
+        if (connected)
+            forward();
+        else if (attempts_ < connect_options_.attempts && Health::clock::now() < deadline_
+                 && client_stream_socket_.is_open())
+            retry();
+        else close();
+    }
+
+    void retry() {
+        boost::system::error_code error;
+        server_stream_socket_.close(error);
+        Backend* failed = backend_;
+        backend_ = balancer_.pick(client_stream_socket_.remote_endpoint(error), failed);
+        balancer_.release(failed);
+        connect();
+    }
+
+    void forward() {
+        forwarding_ = true;
+        backend_stats().sessions.add();
+        if (options_.splice && open_pipe(to_client_) && open_pipe(to_server_)) {
+            boost::system::error_code ignored;
+            client_stream_socket_.native_non_blocking(true, ignored);
+            server_stream_socket_.native_non_blocking(true, ignored);
+            pump(to_client_);
+            pump(to_server_);
+            return;
+        }
+        start_read(to_client_);
+        start_read(to_server_);
+    }
+
+    void start_read(Direction& direction) {
+        if (direction.reading || direction.eof || direction.ring.room() == 0 || !direction.from.is_open())
+            return;
+        direction.reading = true;
+        boost::shared_ptr<Session> self = shared_from_this();
+        direction.from.async_read_some(direction.ring.space(options_.read_size), make_alloc_handler(
+                direction.read_memory,
+                [this, self, &direction](const boost::system::error_code& error, size_t bytes_transferred) {
+                    handle_read(direction, error, bytes_transferred);
+                }));
+    }
+
+    void start_write(Direction& direction) {
+        if (direction.writing || direction.ring.empty() || !direction.to.is_open())
+            return;
+        direction.writing = true;
+        boost::shared_ptr<Session> self = shared_from_this();
+        direction.to.async_write_some(direction.ring.data(), make_alloc_handler(
+                direction.write_memory,
+                [this, self, &direction](const boost::system::error_code& error, size_t bytes_transferred) {
+                    handle_write(direction, error, bytes_transferred);
+                }));
+    }
+
+    //Read from server/client stream. On end-of-file the data already read
+    //still goes out before the end is passed on.
+    void handle_read(Direction& direction, const boost::system::error_code& error, size_t bytes_transferred) {
+        direction.reading = false;
+        if (error == boost::asio::error::eof) {
+            direction.eof = true;
+            if (!direction.writing && direction.ring.empty())
+                finish(direction);
+            return;
+        }
+        if (error) {
+            fail(error);
+            return;
+        }
+        direction.ring.commit(bytes_transferred);
+        bytes(direction).add(bytes_transferred);
+        start_write(direction);
+        start_read(direction);
+    }
+
+    //Write to server/client stream
+    void handle_write(Direction& direction, const boost::system::error_code& error, size_t bytes_transferred) {
+        direction.writing = false;
+        if (error) {
+            fail(error);
+            return;
+        }
+        direction.ring.consume(bytes_transferred);
+        if (direction.eof && direction.ring.empty()) {
+            finish(direction);
+            return;
+        }
+        start_write(direction);
+        start_read(direction);
+    }
+
+#ifdef __linux__
+    //Pipe of about buffer_size bytes; the kernel may round it or cap it at
+    //fs.pipe-max-size.
+    bool open_pipe(Direction& direction) {
+        if (pipe2(direction.pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+            direction.pipe[0] = direction.pipe[1] = -1;
+            return false;
+        }
+        fcntl(direction.pipe[1], F_SETPIPE_SZ, int(options_.buffer_size));
+        int size = fcntl(direction.pipe[1], F_GETPIPE_SZ);
+        direction.pipe_size = size > 0 ? size : 65536;
+        return true;
+    }
+
+    //Moves whatever can be moved without blocking, then waits on the one
+    //socket that holds things up: the destination while the pipe has
+    //data, the source otherwise. Waiting for the source only with an empty
+    //pipe keeps a pipe that is full (in pages, before it is full in bytes)
+    //from looking like a readable socket that yields nothing.
+    void pump(Direction& direction) {
+        if (!direction.from.is_open() || !direction.to.is_open())
+            return;
+        int from = direction.from.native_handle();
+        int to = direction.to.native_handle();
+        bool progress = true;
+        while (progress) {
+            progress = false;
+            if (!direction.eof && direction.piped < direction.pipe_size) {
+                ssize_t moved = ::splice(from, nullptr, direction.pipe[1], nullptr,
+                                         direction.pipe_size - direction.piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (moved > 0) {
+                    direction.piped += moved;
+                    bytes(direction).add(moved);
+                    progress = true;
+                }
+                else if (moved == 0)
+                    direction.eof = true;
+                else if ((errno == EINVAL || errno == ENOSYS) && direction.piped == 0) {
+                    fall_back(direction);
+                    return;
+                }
+                else if (errno != EAGAIN && errno != EINTR) {
+                    fail(boost::system::error_code(errno, boost::system::system_category()));
+                    return;
+                }
+            }
+            if (direction.piped > 0) {
+                ssize_t moved = ::splice(direction.pipe[0], nullptr, to, nullptr,
+                                         direction.piped, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+                if (moved > 0) {
+                    direction.piped -= moved;
+                    progress = true;
+                }
+                else if (moved < 0 && errno != EAGAIN && errno != EINTR) {
+                    fail(boost::system::error_code(errno, boost::system::system_category()));
+                    return;
+                }
+            }
+        }
+        if (direction.eof && direction.piped == 0)
+            finish(direction);
+        else if (direction.piped > 0)
+            wait(direction, direction.to, tcp::socket::wait_write, direction.writing, direction.write_memory);
+        else
+            wait(direction, direction.from, tcp::socket::wait_read, direction.reading, direction.read_memory);
+    }
+
+    void wait(Direction& direction, tcp::socket& socket, tcp::socket::wait_type type, bool& waiting,
+              HandlerMemory& memory) {
+        if (waiting)
+            return;
+        waiting = true;
+        boost::shared_ptr<Session> self = shared_from_this();
+        socket.async_wait(type, make_alloc_handler(memory,
+                [this, self, &direction, &waiting](const boost::system::error_code& error) {
+                    handle_wait(direction, waiting, error);
+                }));
+    }
+
+    void handle_wait(Direction& direction, bool& waiting, const boost::system::error_code& error) {
+        waiting = false;
+        if (error) {
+            fail(error);
+            return;
+        }
+        pump(direction);
+    }
+
+    //Back to the ring for this direction; nothing has gone through the
+    //pipe yet.
+    void fall_back(Direction& direction) {
+        ::close(direction.pipe[0]);
+        ::close(direction.pipe[1]);
+        direction.pipe[0] = direction.pipe[1] = -1;
+        start_read(direction);
+    }
+#else
+    bool open_pipe(Direction&) { return false; }
+    void pump(Direction&) {}
+#endif
+
+    BackendStats& backend_stats() {
+        return stats_.backends[backend_->index];
+    }
+
+    //Client -> backend counts as in, backend -> client as out.
+    Counter& bytes(Direction& direction) {
+        return &direction == &to_server_ ? backend_stats().bytes_in : backend_stats().bytes_out;
+    }
+
+    //Close on an I/O error. Operations that the close itself cancels
+    //don't count as errors.
+    void fail(const boost::system::error_code& error) {
+        if (error != boost::asio::error::operation_aborted && error != boost::asio::error::bad_descriptor)
+            backend_stats().io_errors.add();
+        close();
+    }
+
+    //The source of `direction` has ended and all it sent went out: end the
+    //destination's half as well, and close once the other direction has
+    //ended too.
+    void finish(Direction& direction) {
+        direction.done = true;
+        boost::system::error_code ignored;
+        direction.to.shutdown(tcp::socket::shutdown_send, ignored);
+        if (to_server_.done && to_client_.done)
+            close();
+    }
+
+    //Close connections
+    void close() {
+        if (client_stream_socket_.is_open()) {
+            client_stream_socket_.close();
+        }
+        if (server_stream_socket_.is_open()) {
+            server_stream_socket_.close();
+        }
+    }
+
+    std::shared_ptr<Route> route_;
+    tcp::socket client_stream_socket_;
+    tcp::socket server_stream_socket_;
+    Balancer& balancer_;
+    Health& health_;
+    Backend* backend_;
+    const ConnectOptions& connect_options_;
+    boost::asio::steady_timer connect_timer_;
+    HandlerMemory connect_memory_, timer_memory_;
+    unsigned attempts_;
+    Health::clock::time_point deadline_, connect_started_;
+    const SessionOptions& options_;
+    WarmPools* pools_;
+    PortStats& stats_;
+    bool connecting_, started_, forwarding_;
+    Direction to_server_;
+    Direction to_client_;
+};
+
+#endif //PROXY_SESSION_H
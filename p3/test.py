@@ -0,0 +1,372 @@
+import os
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import unittest
+
+Cmdline = ["./proxy_server"]
+IP = "127.0.0.1"
+Port = 3200
+BackendPort = 3201
+#Nobody listens on DeadPort, or nobody answers. The second port of the
+#proxy and the second backend are for reloads.
+DeadPort = 3202
+SecondPort = 3203
+SecondBackendPort = 3204
+
+def waitFor(func, timeout=0.5):
+    t = time.time()
+
+    while (time.time() - t) < timeout:
+        if func():
+            return True
+        time.sleep(0.001)
+
+    return False
+
+def recvAll(s, chunk=65536, delay=0):
+    data = []
+    while True:
+        part = s.recv(chunk)
+        if not part:
+            return b"".join(data)
+        data.append(part)
+        if delay:
+            time.sleep(delay)
+
+def recvExactly(s, length):
+    data = b""
+    while len(data) < length:
+        part = s.recv(length - len(data))
+        if not part:
+            break
+        data += part
+    return data
+
+def pattern(length):
+    block = bytes(bytearray(range(256))) * 256
+    return (block * (length // len(block) + 1))[:length]
+
+def echo(conn):
+    while True:
+        data = conn.recv(65536)
+        if not data:
+            return
+        conn.sendall(data)
+
+#Says `name` first, then echoes.
+def named(name):
+    def handler(conn):
+        conn.sendall(name)
+        echo(conn)
+    return handler
+
+class Backend(object):
+    """Listens on `port` and runs handler(socket) on a thread of its own
+    for every connection."""
+
+    def __init__(self, handler, port=BackendPort):
+        self.handler = handler
+        self.errors = []
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind((IP, port))
+        self.listener.listen(16)
+        self.worker = threading.Thread(target=self._accept)
+        self.worker.daemon = True
+        self.worker.start()
+
+    def close(self):
+        #Wakes the accept() so that the port is free for the next test.
+        try:
+            self.listener.shutdown(socket.SHUT_RDWR)
+        except socket.error:
+            pass
+        self.listener.close()
+        self.worker.join()
+
+    def _accept(self):
+        while True:
+            try:
+                conn, _ = self.listener.accept()
+            except socket.error:
+                return
+            worker = threading.Thread(target=self._serve, args=(conn,))
+            worker.daemon = True
+            worker.start()
+
+    def _serve(self, conn):
+        try:
+            self.handler(conn)
+        except Exception as e:
+            self.errors.append(e)
+        finally:
+            conn.close()
+
+class Blackhole(object):
+    """A listener on `port` that never accepts, with its queue filled, so
+    that further connects get no answer at all."""
+
+    def __init__(self, port):
+        self.listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        self.listener.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.listener.bind((IP, port))
+        self.listener.listen(0)
+        self.fill = []
+        for i in range(4):
+            s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+            s.setblocking(False)
+            try:
+                s.connect((IP, port))
+            except socket.error:
+                pass
+            self.fill.append(s)
+
+    def close(self):
+        for s in self.fill:
+            s.close()
+        self.listener.close()
+
+class TestBase(unittest.TestCase):
+    Args = []
+    #Health probes would look like clients to the backends.
+    Settings = "%d,%s:%d,check_ms=0\n" % (Port, IP, BackendPort)
+
+    def setUp(self):
+        self.settings = tempfile.NamedTemporaryFile(mode="w", suffix=".settings", delete=False)
+        self.settings.write(self.Settings)
+        self.settings.close()
+        self.backends = []
+        sys.stderr.write("Staring server.\n")
+        self.server = subprocess.Popen(Cmdline + self.Args + [self.settings.name], stdout=subprocess.PIPE)
+        time.sleep(0.1)
+
+    def tearDown(self):
+        sys.stderr.write("Stopping server.\n")
+        if self.server.poll() is None:
+            self.server.kill()
+        self.server.wait()
+        self.server.stdout.close()
+        for backend in self.backends:
+            backend.close()
+        os.unlink(self.settings.name)
+
+    def startBackend(self, handler, port=BackendPort):
+        self.backends.append(Backend(handler, port))
+        return self.backends[-1]
+
+    def newClient(self, port=Port):
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.settimeout(5)
+        s.connect((IP, port))
+        return s
+
+    #A client of `port` whose line comes back; False if the proxy gave up.
+    def answers(self, port=Port, expect=b""):
+        c = self.newClient(port)
+        try:
+            c.sendall(b"ping\n")
+            return recvExactly(c, len(expect) + 5) == expect + b"ping\n"
+        except socket.error:
+            return False
+        finally:
+            c.close()
+
+class Test1(TestBase):
+    def test_echo(self):
+        self.startBackend(echo)
+
+        c = self.newClient()
+        c.sendall(b"hello\n")
+        self.assertEqual(c.recv(100), b"hello\n")
+        c.close()
+
+class Test2(TestBase):
+    #The client ends its half; the backend answers after reading to the end.
+    def test_clientHalfClose(self):
+        request = pattern(1 << 20)
+        def answer(conn):
+            data = recvAll(conn)
+            conn.sendall(str(len(data)).encode() + b"\n" + data[::-1])
+        backend = self.startBackend(answer)
+
+        c = self.newClient()
+        c.sendall(request)
+        c.shutdown(socket.SHUT_WR)
+        reply = recvAll(c)
+        self.assertEqual(reply, str(len(request)).encode() + b"\n" + request[::-1],
+            "Reply after the client's end-of-file was lost or cut.")
+        c.close()
+        self.assertEqual(backend.errors, [])
+
+    #The backend ends its half and still reads what the client sends.
+    def test_serverHalfClose(self):
+        received = []
+        def stream(conn):
+            conn.sendall(pattern(1 << 20))
+            conn.shutdown(socket.SHUT_WR)
+            received.append(recvAll(conn))
+        self.startBackend(stream)
+
+        c = self.newClient()
+        self.assertEqual(recvAll(c), pattern(1 << 20))
+        c.sendall(b"after the end\n")
+        c.shutdown(socket.SHUT_WR)
+        self.assertTrue(waitFor(lambda: received, timeout=3))
+        self.assertEqual(received[0], b"after the end\n",
+            "Data sent after the server's end-of-file did not arrive.")
+        self.assertEqual(c.recv(100), b"")
+        c.close()
+
+class Test3(TestBase):
+    #Readers that take small pieces and sleep in between: the proxy's
+    #writes only go through in part, and the end of each direction has to
+    #wait for the data it holds.
+    def test_slowReaders(self):
+        request = pattern(2 << 20)
+        def slowSink(conn):
+            data = recvAll(conn, 4096, 0.001)
+            conn.sendall(str(len(data)).encode() + b" " + str(data == request).encode())
+        self.startBackend(slowSink)
+
+        c = self.newClient()
+        for i in range(0, len(request), 100000):
+            c.sendall(request[i:i + 100000])
+        c.shutdown(socket.SHUT_WR)
+        c.settimeout(30)
+        self.assertEqual(recvAll(c), str(len(request)).encode() + b" True")
+        c.close()
+
+    def test_slowClient(self):
+        response = pattern(2 << 20)
+        def burst(conn):
+            conn.sendall(response)
+        self.startBackend(burst)
+
+        c = self.newClient()
+        c.settimeout(30)
+        self.assertEqual(recvAll(c, 4096, 0.001), response,
+            "Response to a slow client was cut when the server closed.")
+        c.close()
+
+class Test4(TestBase):
+    #A full close, not a half one, ends both connections.
+    def test_closeEndsBoth(self):
+        ended = threading.Event()
+        def endless(conn):
+            try:
+                while conn.recv(65536):
+                    pass
+            except socket.error:
+                pass
+            ended.set()
+        self.startBackend(endless)
+
+        c = self.newClient()
+        c.sendall(b"x" * 1000)
+        c.close()
+        self.assertTrue(ended.wait(3), "Backend connection outlived the client.")
+
+    def test_resetEndsBoth(self):
+        ended = threading.Event()
+        def talker(conn):
+            try:
+                while True:
+                    conn.sendall(b"y" * 65536)
+            except socket.error:
+                pass
+            ended.set()
+        self.startBackend(talker)
+
+        c = self.newClient()
+        c.shutdown(socket.SHUT_WR)
+        c.recv(100)
+        c.close()
+        self.assertTrue(ended.wait(3), "Backend kept writing to a client that went away.")
+
+#The same through splice().
+class Test5(Test2):
+    Args = ["-z"]
+
+class Test6(Test3):
+    Args = ["-z"]
+
+class Test7(Test4):
+    Args = ["-z"]
+
+#A dead backend is taken out after its first failure: by the sessions
+#that fail to reach it, or by the probes before any client comes.
+class Test8(TestBase):
+    Settings = "%d,%s:%d,%s:%d,policy=round_robin,check_ms=0,eject_failures=1,eject_ms=10000,connect_attempts=1\n" \
+               % (Port, IP, DeadPort, IP, BackendPort)
+
+    def test_passiveEjection(self):
+        self.startBackend(echo)
+        results = [self.answers() for i in range(10)]
+        self.assertTrue(results.count(False) <= 1, "Dead backend was not ejected: %s" % results)
+        self.assertTrue(all(results[2:]), "Sessions still go to the dead backend: %s" % results)
+
+class Test9(TestBase):
+    Settings = "%d,%s:%d,%s:%d,policy=round_robin,check_ms=50,eject_failures=1,eject_ms=10000,connect_attempts=1\n" \
+               % (Port, IP, DeadPort, IP, BackendPort)
+
+    #The live backend has to be up before the first probe.
+    def setUp(self):
+        backend = Backend(echo)
+        TestBase.setUp(self)
+        self.backends.append(backend)
+
+    def test_activeEjection(self):
+        time.sleep(0.3)
+        results = [self.answers() for i in range(10)]
+        self.assertTrue(all(results), "Probes did not eject the dead backend: %s" % results)
+
+#A backend that never answers the connect: the attempt times out and the
+#session goes on to the other backend.
+class Test10(TestBase):
+    Settings = "%d,%s:%d,%s:%d,policy=round_robin,check_ms=0,connect_timeout_ms=200,connect_attempts=2\n" \
+               % (Port, IP, DeadPort, IP, BackendPort)
+
+    def setUp(self):
+        self.blackhole = Blackhole(DeadPort)
+        TestBase.setUp(self)
+
+    def tearDown(self):
+        TestBase.tearDown(self)
+        self.blackhole.close()
+
+    def test_connectTimeout(self):
+        self.startBackend(echo)
+        started = time.time()
+        self.assertTrue(self.answers(), "Session was not retried on the live backend.")
+        elapsed = time.time() - started
+        self.assertTrue(0.15 < elapsed < 2, "First attempt took %.2f s, not the connect timeout." % elapsed)
+        self.assertTrue(self.answers(), "Session to the live backend failed.")
+
+#A reload changes the backend of a port and adds a second port; a session
+#from before keeps its backend.
+class Test11(TestBase):
+    def test_reload(self):
+        self.startBackend(named(b"first\n"))
+        self.startBackend(named(b"second\n"), SecondBackendPort)
+        before = self.newClient()
+        self.assertEqual(recvExactly(before, 6), b"first\n")
+
+        with open(self.settings.name, "w") as f:
+            f.write("%d,%s:%d,check_ms=0\n%d,%s:%d,check_ms=0\n"
+                    % (Port, IP, SecondBackendPort, SecondPort, IP, BackendPort))
+        self.server.send_signal(signal.SIGHUP)
+
+        self.assertTrue(waitFor(lambda: self.answers(Port, b"second\n"), timeout=3),
+            "Changed destination was not used after the reload.")
+        self.assertTrue(self.answers(SecondPort, b"first\n"), "Added port does not forward.")
+        before.sendall(b"still\n")
+        self.assertEqual(recvExactly(before, 6), b"still\n", "Session from before the reload broke.")
+        before.close()
+
+if __name__ == '__main__':
+    unittest.main()
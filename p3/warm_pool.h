@@ -0,0 +1,163 @@
+#ifndef PROXY_WARM_POOL_H
+#define PROXY_WARM_POOL_H
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <vector>
+
+#include <poll.h>
+
+#include <boost/bind.hpp>
+#include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include "balancer.h"
+
+#ifndef POLLRDHUP
+#define POLLRDHUP 0
+#endif
+
+//Sizes of the warm pools; there are no pools while max is 0.
+struct PoolOptions {
+    size_t min = 0;                 //idle connections kept ready
+    size_t max = 0;                 //most kept ready after a burst of misses
+    unsigned idle_ms = 30000;       //an idle connection older than this is closed
+};
+
+//Connections to one backend, opened ahead of time on one thread's
+//io_service, so a session on that thread takes a connected socket instead
+//of waiting for a handshake. Single-threaded like everything else on the
+//service.
+//
+//The pool aims at `target_` idle connections: min to start with, one more
+//(up to max) for every take that found the pool empty, and back down
+//towards min each sweep without misses. A sweep runs every second: it
+//closes connections that have been idle too long and retries the refill
+//after a failed connect.
+//
+//Pending handlers keep the pool alive. stop() closes the idle connections
+//and ends the refills, before the backend goes away on a reload.
+class WarmPool : public std::enable_shared_from_this<WarmPool> {
+public:
+    typedef boost::asio::ip::tcp tcp;
+
+    WarmPool(boost::asio::io_service& io_service, Backend& backend, const PoolOptions& options)
+    : io_service_(io_service), backend_(backend), options_(options), timer_(io_service),
+      connecting_(0), target_(options.min), missed_(false), failing_(false), stopped_(false) {}
+
+    void start() {
+        fill();
+        schedule_sweep();
+    }
+
+    void stop() {
+        stopped_ = true;
+        idle_.clear();
+        boost::system::error_code ignored;
+        timer_.cancel(ignored);
+    }
+
+    //Moves a ready connection into `socket`, the oldest so that none sits
+    //until it expires; false if there is none.
+    bool take(tcp::socket& socket) {
+        while (!idle_.empty()) {
+            Idle idle = std::move(idle_.front());
+            idle_.pop_front();
+            if (closed(idle.socket))
+                continue;
+            socket = std::move(idle.socket);
+            fill();
+            return true;
+        }
+        if (target_ < std::max(options_.min, options_.max))
+            ++target_;
+        missed_ = true;
+        fill();
+        return false;
+    }
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct Idle {
+        Idle(tcp::socket&& socket) : socket(std::move(socket)), since(clock::now()) {}
+
+        tcp::socket socket;
+        clock::time_point since;
+    };
+
+    void fill() {
+        while (!failing_ && !stopped_ && idle_.size() + connecting_ < target_)
+            connect();
+    }
+
+    void connect() {
+        ++connecting_;
+        std::shared_ptr<tcp::socket> socket(new tcp::socket(io_service_));
+        socket->async_connect(backend_.endpoint,
+                              boost::bind(&WarmPool::handle_connect,
+                                          shared_from_this(),
+                                          socket,
+                                          boost::asio::placeholders::error));
+    }
+
+    void handle_connect(std::shared_ptr<tcp::socket> socket, const boost::system::error_code& error) {
+        --connecting_;
+        if (stopped_)
+            return;
+        if (error) {
+            //The sweep tries again; no reconnect storm to a dead backend.
+            failing_ = true;
+            return;
+        }
+        idle_.emplace_back(std::move(*socket));
+        fill();
+    }
+
+    void schedule_sweep() {
+        timer_.expires_from_now(std::chrono::seconds(1));
+        timer_.async_wait(boost::bind(&WarmPool::sweep, shared_from_this(), boost::asio::placeholders::error));
+    }
+
+    //Oldest first, so expired connections are at the front.
+    void sweep(const boost::system::error_code& error) {
+        if (error || stopped_)
+            return;
+        clock::time_point expired = clock::now() - std::chrono::milliseconds(options_.idle_ms);
+        while (!idle_.empty() && idle_.front().since < expired)
+            idle_.pop_front();
+        idle_.erase(std::remove_if(idle_.begin(), idle_.end(), [](Idle& idle) { return closed(idle.socket); }),
+                    idle_.end());
+        if (!missed_ && target_ > options_.min)
+            --target_;
+        while (idle_.size() > target_)
+            idle_.pop_back();
+        missed_ = false;
+        failing_ = false;
+        fill();
+        schedule_sweep();
+    }
+
+    //The backend closed or reset it while it sat in the pool. Data
+    //waiting on it (a greeting) is fine; it goes to the client.
+    static bool closed(tcp::socket& socket) {
+        struct pollfd fd = { socket.native_handle(), POLLRDHUP, 0 };
+        return poll(&fd, 1, 0) != 0;
+    }
+
+    boost::asio::io_service& io_service_;
+    Backend& backend_;
+    const PoolOptions& options_;
+    boost::asio::steady_timer timer_;
+    std::deque<Idle> idle_;
+    size_t connecting_;
+    size_t target_;
+    bool missed_, failing_, stopped_;
+};
+
+//A thread's pools for one port, by backend index.
+typedef std::vector<std::shared_ptr<WarmPool>> WarmPools;
+
+#endif //PROXY_WARM_POOL_H